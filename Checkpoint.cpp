@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+
+#include "Checkpoint.h"
+
+class CheckpointHeader {
+public:
+    uint32_t	magic;
+    uint32_t	version;
+    uint32_t	size;		// of the data after the header
+    uint32_t	sum;		// FNV-1a of the data
+};
+
+static uint32_t checksum(const void *data, size_t size) {
+    const uint8_t	*p = (const uint8_t *) data;
+    uint32_t		h = 2166136261u;
+
+    for (size_t i = 0; i < size; i++) {
+	h ^= p[i];
+	h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+ * Written to a temporary file, synced and renamed over the old one, so a
+ * crash or power loss leaves either the old or the new checkpoint.
+ */
+
+bool storeCheckpoint(const char *filename, const CheckpointData &data) {
+    CheckpointHeader	header;
+    std::string		tmp = std::string(filename) + ".tmp";
+
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.size = sizeof(data);
+    header.sum = checksum(&data, sizeof(data));
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+	return false;
+    }
+
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+	write(fd, &data, sizeof(data)) == sizeof(data) &&
+	fsync(fd) == 0;
+
+    if (close(fd) != 0) {
+	ok = false;
+    }
+
+    if (!ok || rename(tmp.c_str(), filename) != 0) {
+	unlink(tmp.c_str());
+	return false;
+    }
+
+    return true;
+}
+
+/*
+ * False when there is no checkpoint or it is from another version, cut
+ * short or damaged. data is left untouched then.
+ */
+
+bool loadCheckpoint(const char *filename, CheckpointData &data) {
+    CheckpointHeader	header;
+    CheckpointData	tmp;
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+	return false;
+    }
+
+    bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+	header.magic == CHECKPOINT_MAGIC &&
+	header.version == CHECKPOINT_VERSION &&
+	header.size == sizeof(tmp) &&
+	read(fd, &tmp, sizeof(tmp)) == sizeof(tmp) &&
+	header.sum == checksum(&tmp, sizeof(tmp));
+
+    close(fd);
+
+    if (ok) {
+	data = tmp;
+    }
+
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <inttypes.h>
+#include <type_traits>
+
+#include "Compensation.h"
+#include "FusionEngine.h"
+
+/*
+ * Warm start state, what imu.json does not keep: the attitude and the
+ * calibration window with its noise thresholds. The file is a header and
+ * this struct as it is in memory, so it is only good for the same build
+ * on the same machine. Any change to the layout must bump the version.
+ */
+
+#define CHECKPOINT_MAGIC	0x50434d49	// "IMCP"
+#define CHECKPOINT_VERSION	1
+
+class CheckpointData {
+public:
+    double		saved = 0.0;		// CLOCK_REALTIME, s
+    char		engine[16] = "";	// FusionEngine::getName()
+    AHRSState		fusion = AHRSState();
+    CalibrationStats	window;
+    double		gNoise = 0.0;
+    double		aNoise = 0.0;
+};
+
+static_assert(std::is_trivially_copyable<CheckpointData>::value, "CheckpointData is written as raw bytes");
+
+bool storeCheckpoint(const char *filename, const CheckpointData &data);
+bool loadCheckpoint(const char *filename, CheckpointData &data);
+
+#endif
@@ -2,6 +2,14 @@
 #include <iostream>
 
 #include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "Compensation.h"
 
 CalibrationItem::CalibrationItem() {
@@ -14,14 +22,82 @@ CalibrationItem::CalibrationItem() {
     }
 }
 
-void CalibrationItem::set(int16_t m[9]) {
-    r = sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+/*
+ * Takes a frame with the raw temperature in word 9
+ */
+
+void CalibrationItem::set(const int16_t m[10]) {
+    r = sqrt((double) m[0]*m[0] + (double) m[1]*m[1] + (double) m[2]*m[2]);
 
     for (int i = 0; i < 3; i++) {
 	this->a[i] = m[i];
 	this->g[i] = m[i+3];
 	this->m[i] = m[i+6];
     }
+
+    t = m[9];
+}
+
+///
+
+void KahanSum::add(double x) {
+    double y = x - c;
+    double t = sum + y;
+
+    c = (t - sum) - y;
+    sum = t;
+}
+
+///
+
+void AffineCorrection::set(const double offset[3], const double scale[3], const double matrix[3][3], double unit) {
+    for (int r = 0; r < 3; r++) {
+	double b = 0;
+
+	for (int c = 0; c < 3; c++) {
+	    double k = unit * matrix[r][c] / scale[c];
+
+	    col[c][r] = k;
+	    b -= k * offset[c];
+	}
+
+	bias[r] = b;
+    }
+
+    for (int c = 0; c < 3; c++)
+	col[c][3] = 0;
+
+    bias[3] = 0;
+}
+
+static void loadMatrix(json_value& args, double matrix[3][3]) {
+    for (int r = 0; r < 3; r++)
+	for (int c = 0; c < 3; c++)
+	    matrix[r][c] = (r == c) ? 1.0 : 0.0;
+
+    if (!args.is_array() || args.as_array().size() != 9) {
+	return;
+    }
+
+    /* All or nothing, a bad element leaves the identity */
+
+    double	m[9];
+
+    try {
+	for (int i = 0; i < 9; i++)
+	    m[i] = number(args.as_array()[i]);
+    } catch (json_error const &e) {
+	std::cout << e.what() << std::endl;
+	return;
+    }
+
+    for (int i = 0; i < 9; i++)
+	matrix[i / 3][i % 3] = m[i];
+}
+
+static void storeMatrix(json_array& args, const double matrix[3][3]) {
+    for (int i = 0; i < 9; i++)
+	args.push_back(matrix[i / 3][i % 3]);
 }
 
 ///
@@ -33,119 +109,333 @@ Compensation::Compensation() {
 	g_offset[i] = 0.0;
 	m_offset[i] = 0.0;
 	m_scale[i] = 1.0;
+
+	for (int n = 0; n < 3; n++) {
+	    a_matrix[i][n] = (i == n) ? 1.0 : 0.0;
+	    g_matrix[i][n] = (i == n) ? 1.0 : 0.0;
+	    m_matrix[i][n] = (i == n) ? 1.0 : 0.0;
+	}
     }
 
-    itemIndex = 0;
     aValid = false;
     gValid = false;
     mValid = false;
+
+    setWindow(itemsNum);
+    clearMag();
+    updateCorrection();
+}
+
+void Compensation::setUnits(double accel, double gyro, double mag) {
+    aUnit = accel;
+    gUnit = gyro;
+    mUnit = mag;
+
+    updateCorrection();
+}
+
+void Compensation::setTemperatureUnit(double unit, double base) {
+    tUnit = unit;
+    tBase = base;
+}
+
+/*
+ * Must be called after any offset, scale or matrix change. Safe while
+ * another thread runs doIt(), which picks up the new set on its next call.
+ */
+
+void Compensation::updateCorrection() {
+    CorrectionSet	set;
+    const double	one[3] = { 1.0, 1.0, 1.0 };
+    double		offset[3];
+
+    for (int i = 0; i < 3; i++)
+	offset[i] = a_offset[i] + aTemp[i];
+
+    set.accel.set(offset, a_scale, a_matrix, aUnit);
+    set.gyro.set(g_offset, one, g_matrix, gUnit);
+    set.mag.set(m_offset, m_scale, m_matrix, mUnit);
+
+    correction.store(set);
 }
 
-void Compensation::calibrateItem(int16_t m[9]) {
-    items[itemIndex].set(m);
+void Compensation::clearWindow() {
+    items.assign(itemsNum, CalibrationItem());
+    itemIndex = 0;
+    itemsCount = 0;
+
+    for (int i = 0; i < 3; i++) {
+	gSum[i] = 0;
+	gSqSum[i] = 0;
+	aSum[i] = 0;
+	aSqSum[i] = 0;
+	aNormSum[i].clear();
+    }
+
+    tSum = 0;
+
+    stats.store(CalibrationStats());
+}
+
+void Compensation::clearMag() {
+    for (int i = 0; i < 3; i++)
+	magPrev[i] = 0;
+
+    magFit.clear();
+    magPending = 0;
+
+    magResult.store(EllipsoidResult());
+}
+
+/*
+ * Must not run concurrently with calibrateItem()
+ */
+
+void Compensation::setWindow(int n) {
+    itemsNum = n > 1 ? n : 2;
+    clearWindow();
+}
+
+/*
+ * The window sums are updated by removing the oldest item and adding the new
+ * one, then published as one snapshot, so readers never rescan the window
+ * and never see a half-updated state.
+ */
+
+void Compensation::accumulate(const CalibrationItem &item, double sign) {
+    for (int n = 0; n < 3; n++) {
+	gSum[n] += sign * item.g[n];
+	gSqSum[n] += sign * item.g[n] * item.g[n];
+	aSum[n] += sign * item.a[n];
+	aSqSum[n] += sign * item.a[n] * item.a[n];
+
+	if (item.r != 0) {
+	    aNormSum[n].add(sign * item.a[n] / item.r);
+	}
+    }
+
+    tSum += sign * item.t;
+}
+
+void Compensation::publishStats() {
+    CalibrationStats	s;
+
+    s.n = itemsCount;
+
+    for (int n = 0; n < 3; n++) {
+	s.g[n] = gSum[n];
+	s.gg[n] = gSqSum[n];
+	s.a[n] = aSum[n];
+	s.aa[n] = aSqSum[n];
+	s.aNorm[n] = aNormSum[n].get();
+    }
+
+    s.t = tSum;
+    stats.store(s);
+}
+
+void Compensation::calibrateItem(const int16_t m[10]) {
+    CalibrationItem	&item = items[itemIndex];
+
+    if (itemsCount == itemsNum) {
+	accumulate(item, -1.0);
+    } else {
+	itemsCount++;
+    }
+
+    item.set(m);
+    accumulate(item, 1.0);
 
     itemIndex = (itemIndex + 1) % itemsNum;
+
+    publishStats();
+}
+
+/*
+ * Mag runs slower than the calibration loop, only new readings go into the
+ * ellipsoid fit. Solving is not free, it is done every 10 readings. Startup
+ * calibration only, the fusion side never calls it.
+ */
+
+void Compensation::calibrateMag(const int16_t m[3]) {
+    if (memcmp(magPrev, m, sizeof(magPrev)) == 0) {
+	return;
+    }
+
+    memcpy(magPrev, m, sizeof(magPrev));
+    magFit.add(m[0], m[1], m[2]);
+
+    if (++magPending >= 10) {
+	EllipsoidResult	r;
+
+	magPending = 0;
+	magFit.solve(r);
+	magResult.store(r);
+    }
 }
 
+/*
+ * Must not run concurrently with calibrateItem() or calibrateMag()
+ */
+
 void Compensation::clearCalibration() {
     for (int i = 0; i < 3; i++) {
 	aMin[i] = 0;
 	aMax[i] = 0;
-	mMin[i] = 0;
-	mMax[i] = 0;
     }
+
+    clearWindow();
+    clearMag();
+    mSamples = 0;
 }
 
-bool Compensation::calibrated() {
-    return gValid && aValid && mValid;
+/*
+ * Window sums for a checkpoint, safe from any thread
+ */
+
+void Compensation::getWindowStats(CalibrationStats &s) const {
+    stats.load(s);
 }
 
-void Compensation::calcGyroAvr() {
-    for (int i = 0; i < 3; i++)
-	gAvr[i] = 0;
+/*
+ * Refills the window from checkpointed sums. The items themselves are not
+ * kept, so pairs of items at the average plus and minus the sigma stand in
+ * for them: averages and sigmas are as before and they age out of the
+ * window like real ones. Must not run concurrently with calibrateItem().
+ */
 
-    for (int i = 0; i < itemsNum; i++)
-	for (int n = 0; n < 3; n++)
-	    gAvr[n] += items[i].g[n];
+bool Compensation::restoreWindow(const CalibrationStats &s) {
+    clearWindow();
 
-    for (int n = 0; n < 3; n++)
-	gAvr[n] /= itemsNum;
+    if (s.n < 2 || s.n > itemsNum) {
+	return false;
+    }
+
+    int		pairs = s.n / 2;
+    double	k = sqrt((double) s.n / (2 * pairs));
+    double	ga[3], gd[3], aa[3], ad[3];
+
+    for (int n = 0; n < 3; n++) {
+	ga[n] = s.g[n] / s.n;
+	aa[n] = s.a[n] / s.n;
+
+	gd[n] = sqrt(fmax(s.gg[n] / s.n - ga[n] * ga[n], 0.0)) * k;
+	ad[n] = sqrt(fmax(s.aa[n] / s.n - aa[n] * aa[n], 0.0)) * k;
+    }
+
+    for (int i = 0; i < s.n; i++) {
+	CalibrationItem	&item = items[i];
+	double		sign = (i < 2 * pairs) ? ((i & 1) ? -1.0 : 1.0) : 0.0;
+
+	for (int n = 0; n < 3; n++) {
+	    item.g[n] = ga[n] + sign * gd[n];
+	    item.a[n] = aa[n] + sign * ad[n];
+	    item.m[n] = 0;
+	}
+
+	item.r = sqrt(item.a[0] * item.a[0] + item.a[1] * item.a[1] + item.a[2] * item.a[2]);
+	item.t = s.t / s.n;
+
+	accumulate(item, 1.0);
+    }
+
+    itemsCount = s.n;
+    itemIndex = s.n % itemsNum;
+
+    publishStats();
+    return true;
 }
 
-void Compensation::calcMagAvr() {
-    for (int i = 0; i < 3; i++)
-	mAvr[i] = 0;
+void Compensation::getNoise(double &gyro, double &accel) const {
+    gyro = gNoise;
+    accel = aNoise;
+}
 
-    for (int i = 0; i < itemsNum; i++)
-	for (int n = 0; n < 3; n++)
-	    mAvr[n] += items[i].m[n];
+void Compensation::setNoise(double gyro, double accel) {
+    gNoise = gyro;
+    aNoise = accel;
+}
 
-    for (int n = 0; n < 3; n++)
-	mAvr[n] /= itemsNum;
+/*
+ * With gyro == false the gyro offset is left to trackGyro()
+ */
+
+bool Compensation::calibrated(bool gyro) {
+    return (gValid || !gyro) && aValid && mValid;
 }
 
-void Compensation::calcAccelAvr() {
-    for (int i = 0; i < 3; i++) {
-	aAvr[i] = 0;
-	aNorm[i] = 0;
+bool Compensation::calcGyroAvr(CalibrationStats &s) {
+    stats.load(s);
+
+    if (s.n < itemsNum) {
+	return false;
     }
 
-    for (int i = 0; i < itemsNum; i++)
-	for (int n = 0; n < 3; n++) {
-	    aAvr[n] += items[i].a[n];
-	    aNorm[n] += items[i].a[n] / items[i].r;
-	}
+    for (int n = 0; n < 3; n++)
+	gAvr[n] = s.g[n] / s.n;
+
+    tAvr = s.t / s.n * tUnit + tBase;
+
+    return true;
+}
+
+bool Compensation::calcAccelAvr(CalibrationStats &s) {
+    stats.load(s);
+
+    if (s.n < itemsNum) {
+	return false;
+    }
 
     for (int n = 0; n < 3; n++) {
-	aAvr[n] /= itemsNum;
-	aNorm[n] /= itemsNum;
+	aAvr[n] = s.a[n] / s.n;
+	aNorm[n] = s.aNorm[n] / s.n;
     }
-}
 
-void Compensation::getGyroSigma(double &x, double &y, double &z, double &r) {
-    calcGyroAvr();
+    return true;
+}
 
-    double sum[3] = { 0, 0, 0 };
+static void sigma(const double sum[3], const double sqSum[3], int count,
+		  double &x, double &y, double &z, double &r) {
+    double var[3];
 
-    for (int i = 0; i < itemsNum; i++)
-	for (int n = 0; n < 3; n++) {
-	    double delta = gAvr[n] - items[i].g[n];
+    for (int n = 0; n < 3; n++) {
+	double avr = sum[n] / count;
 
-	    sum[n] += delta * delta;
-	}
+	var[n] = sqSum[n] / count - avr * avr;
 
-    x = sum[0] / itemsNum;
-    y = sum[1] / itemsNum;
-    z = sum[2] / itemsNum;
+	if (var[n] < 0)
+	    var[n] = 0;
+    }
 
-    r = sqrt(x + y + z);
+    r = sqrt(var[0] + var[1] + var[2]);
 
-    x = sqrt(x);
-    y = sqrt(y);
-    z = sqrt(z);
+    x = sqrt(var[0]);
+    y = sqrt(var[1]);
+    z = sqrt(var[2]);
 }
 
-void Compensation::getAccelSigma(double &x, double &y, double &z, double &r) {
-    calcAccelAvr();
+/*
+ * Sigma is 0 until the window is full, which callers treat as "no data"
+ */
 
-    double sum[3] = { 0, 0, 0 };
+void Compensation::getGyroSigma(double &x, double &y, double &z, double &r) {
+    CalibrationStats s;
 
-    for (int i = 0; i < itemsNum; i++)
-	for (int n = 0; n < 3; n++) {
-	    double delta = aAvr[n] - items[i].a[n];
+    x = y = z = r = 0;
 
-	    sum[n] += delta * delta;
-	}
+    if (calcGyroAvr(s)) {
+	sigma(s.g, s.gg, s.n, x, y, z, r);
+    }
+}
 
-    x = sum[0] / itemsNum;
-    y = sum[1] / itemsNum;
-    z = sum[2] / itemsNum;
+void Compensation::getAccelSigma(double &x, double &y, double &z, double &r) {
+    CalibrationStats s;
 
-    r = sqrt(x + y + z);
+    x = y = z = r = 0;
 
-    x = sqrt(x);
-    y = sqrt(y);
-    z = sqrt(z);
+    if (calcAccelAvr(s)) {
+	sigma(s.a, s.aa, s.n, x, y, z, r);
+    }
 }
 
 void Compensation::getAccelNorm(double &x, double &y, double &z) {
@@ -168,12 +458,165 @@ bool Compensation::calcGyro(double noise) {
 
 	gNoise = r;
 	gValid = true;
+	updateCorrection();
 	return true;
     }
 
     return false;
 }
 
+/*
+ * Background bias refinement while the device runs. The window counts as
+ * stationary when the gyro sigma is below noise and its average is within
+ * rate of the current offset, which rejects a slow steady turn. Stationary
+ * windows go into the temperature table, which then sets the offsets for
+ * the window temperature. Until the table has data the gyro offset moves
+ * by gain towards the window average, or jumps to it when there was no
+ * valid offset yet. Units are raw LSB.
+ *
+ * Returns true when a stationary window was taken.
+ */
+
+bool Compensation::trackGyro(double noise, double rate, double gain) {
+    CalibrationStats	s;
+    double		x, y, z, r;
+    bool		stationary = true;
+
+    if (!calcGyroAvr(s)) {
+	return false;
+    }
+
+    sigma(s.g, s.gg, s.n, x, y, z, r);
+
+    if (r > noise) {
+	stationary = false;
+    }
+
+    for (int i = 0; i < 3 && stationary && gValid; i++)
+	if (fabs(gAvr[i] - g_offset[i]) > rate)
+	    stationary = false;
+
+    if (stationary && aValid) {
+	double	a[3], c[3];
+
+	for (int i = 0; i < 3; i++)
+	    a[i] = (s.a[i] / s.n - a_offset[i]) / a_scale[i];
+
+	for (int i = 0; i < 3; i++)
+	    c[i] = (a_matrix[i][0] * a[0] + a_matrix[i][1] * a[1] + a_matrix[i][2] * a[2]) * aUnit;
+
+	double	g[3];
+
+	for (int i = 0; i < 3; i++)
+	    g[i] = gAvr[i] + (hwApplied ? g_removed[i] : 0.0);
+
+	tempTable.add(tAvr, g, c);
+    }
+
+    if (applyTemperature(tAvr)) {
+	return stationary;
+    }
+
+    if (!stationary) {
+	return false;
+    }
+
+    if (!gValid) {
+	gain = 1.0;
+    }
+
+    for (int i = 0; i < 3; i++)
+	g_offset[i] += gain * (gAvr[i] - g_offset[i]);
+
+    gValid = true;
+    updateCorrection();
+    return true;
+}
+
+/*
+ * Sets the gyro offset and the accel offset change for die temperature t
+ * (C) from the table. The accel bias is solved in g and taken back to raw
+ * LSB through the scale only, the misalignment matrix is close enough to
+ * identity for a correction of a few mg.
+ */
+
+bool Compensation::applyTemperature(double t) {
+    double	g[3], a[3];
+
+    if (!tempTable.gyro(t, g)) {
+	return false;
+    }
+
+    for (int i = 0; i < 3; i++)
+	g_offset[i] = g[i] - (hwApplied ? g_removed[i] : 0.0);
+
+    if (aValid && tempTable.accel(t, a)) {
+	for (int i = 0; i < 3; i++)
+	    aTemp[i] = a[i] * a_scale[i] / aUnit;
+    }
+
+    gValid = true;
+    updateCorrection();
+    return true;
+}
+
+/*
+ * The sensor now removes accel and gyro (raw LSB) itself, so they are taken
+ * out of the software offsets. What is left is the part below one offset
+ * register step, the correction is then mostly scale and matrix. imu.json
+ * and the temperature table keep the full offsets, the removed part is
+ * kept with the register values. Must not run concurrently with
+ * calibrateItem().
+ */
+
+void Compensation::shiftOffsets(const double accel[3], const double gyro[3]) {
+    if (!hwApplied) {
+	for (int i = 0; i < 3; i++) {
+	    a_removed[i] = 0;
+	    g_removed[i] = 0;
+	}
+
+	hwApplied = true;
+    }
+
+    bool	moved = false;
+
+    for (int i = 0; i < 3; i++) {
+	a_offset[i] -= accel[i];
+	g_offset[i] -= gyro[i];
+	a_removed[i] += accel[i];
+	g_removed[i] += gyro[i];
+	moved = moved || accel[i] != 0 || gyro[i] != 0;
+    }
+
+    /* The window was sampled before the registers moved, trackGyro() waits for a new one */
+
+    if (moved) {
+	clearWindow();
+    }
+
+    updateCorrection();
+}
+
+/*
+ * For the register values of imu.json written back into the sensor, the
+ * part they remove leaves the software offsets
+ */
+
+void Compensation::applyHardware() {
+    if (!hwValid || hwApplied) {
+	return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+	a_offset[i] -= a_removed[i];
+	g_offset[i] -= g_removed[i];
+    }
+
+    hwApplied = true;
+    updateCorrection();
+}
+
 bool Compensation::calcAccel(double noise, double angle) {
     double	x, y, z, r;
     double	e = cos(angle * 3.141526 / 180.0);
@@ -210,49 +653,151 @@ bool Compensation::calcAccel(double noise, double angle) {
 
     aNoise = r;
     aValid = valid;
+    updateCorrection();
     return true;
 }
 
-bool Compensation::calcMag() {
-    bool	valid = true;
-    bool	ok = false;
+void Compensation::getMagFit(double &error, double &ratio, int &samples) {
+    EllipsoidResult	r;
 
-    calcMagAvr();
+    magResult.load(r);
 
-    for (int n = 0; n < 3; n++) {
-	double x = mAvr[n];
+    error = r.error;
+    ratio = r.ratio;
+    samples = r.samples;
+}
 
-	if (x > mMax[n]) {
-	    mMax[n] = x;
-	    ok = true;
-	}
+/*
+ * Takes the latest ellipsoid fit once its RMS radius error and axis ratio
+ * are within limits. Returns true while the solution still moves by more
+ * than 1% of the field, so the caller can tell when rotating is enough.
+ */
 
-	if (x < mMin[n]) {
-	    mMin[n] = x;
-	    ok = true;
-	}
+bool Compensation::calcMag(double error, double ratio) {
+    EllipsoidResult	r;
+    double		shift = 0;
+
+    magResult.load(r);
+
+    if (!r.valid || r.samples <= mSamples) {
+	return false;
+    }
+
+    mSamples = r.samples;
+
+    if (r.samples < 100 || r.error > error || r.ratio > ratio) {
+	return false;
     }
 
     for (int i = 0; i < 3; i++) {
-	m_offset[i] = (mMax[i] + mMin[i]) / 2.0;
-	m_scale[i] = (mMax[i] - mMin[i]) / 1024.0;
+	double d = 0;
 
-	valid = valid && mMax[i] != 0 && mMin[i] != 0;
+	for (int n = 0; n < 3; n++)
+	    d += r.matrix[i][n] * (r.offset[n] - m_offset[n]);
+
+	shift += d * d;
+    }
+
+    /* Corrected field radius is kept at 512 counts, as with the old min/max scaling */
+
+    for (int i = 0; i < 3; i++) {
+	m_offset[i] = r.offset[i];
+	m_scale[i] = 1.0;
+
+	for (int n = 0; n < 3; n++)
+	    m_matrix[i][n] = r.matrix[i][n] * 512.0;
     }
 
-    mValid = valid;
-    return ok;
+    bool moved = !mValid || sqrt(shift) > 0.01 || fabs(r.error - mError) > 0.1 * mError;
+
+    mError = r.error;
+    mRatio = r.ratio;
+    mValid = true;
+    updateCorrection();
+    return moved;
 }
 
-void Compensation::doIt(int16_t m[9], double d[9]) {
-    for (int i = 0; i < 3; i++)
-	d[i] = (m[i] - a_offset[i]) / a_scale[i];
+/*
+ * Corrected output is in g, deg/s and normalized mag units, see setUnits().
+ * Each sensor is one multiply-add per column, no branches, no divisions.
+ */
 
-    for (int i = 0; i < 3; i++)
-	d[i+3] = m[i+3] - g_offset[i];
+#if defined(__SSE2__)
+
+static inline __m128 load3(const int16_t *p) {
+    __m128i v = _mm_loadl_epi64((const __m128i *) p);
+
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+}
+
+static inline void correct(const AffineCorrection &c, const int16_t *in, float *out) {
+    __m128 v = load3(in);
+    __m128 r = _mm_load_ps(c.bias);
+
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c.col[0]), _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0))));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c.col[1]), _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c.col[2]), _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))));
+
+    _mm_storel_pi((__m64 *) out, r);
+    _mm_store_ss(out + 2, _mm_movehl_ps(r, r));
+}
+
+#elif defined(__ARM_NEON)
+
+static inline void correct(const AffineCorrection &c, const int16_t *in, float *out) {
+    float32x4_t v = vcvtq_f32_s32(vmovl_s16(vld1_s16(in)));
+    float32x4_t r = vld1q_f32(c.bias);
+
+    r = vmlaq_n_f32(r, vld1q_f32(c.col[0]), vgetq_lane_f32(v, 0));
+    r = vmlaq_n_f32(r, vld1q_f32(c.col[1]), vgetq_lane_f32(v, 1));
+    r = vmlaq_n_f32(r, vld1q_f32(c.col[2]), vgetq_lane_f32(v, 2));
+
+    vst1_f32(out, vget_low_f32(r));
+    vst1q_lane_f32(out + 2, r, 2);
+}
+
+#else
+
+static inline void correct(const AffineCorrection &c, const int16_t *in, float *out) {
+    float x = in[0], y = in[1], z = in[2];
 
     for (int i = 0; i < 3; i++)
-	d[i+6] = (m[i+6] - m_offset[i]) / m_scale[i];
+	out[i] = c.bias[i] + c.col[0][i] * x + c.col[1][i] * y + c.col[2][i] * z;
+}
+
+#endif
+
+/*
+ * The SIMD kernels load 4 words per sensor, so frames must have at least one
+ * word after the mag (e.g. the temperature of a Sample or FIFO frame).
+ */
+
+void Compensation::doIt(const int16_t *frames, size_t stride, int count, float *d) {
+    CorrectionSet	set;
+    const uint8_t	*p = (const uint8_t *) frames;
+
+    correction.load(set);
+
+    for (int i = 0; i < count; i++, p += stride, d += 9) {
+	const int16_t *m = (const int16_t *) p;
+
+	correct(set.accel, m, d);
+	correct(set.gyro, m + 3, d + 3);
+	correct(set.mag, m + 6, d + 6);
+    }
+}
+
+void Compensation::doIt(const int16_t m[9], double d[9]) {
+    int16_t	frame[12];
+    float	f[9];
+
+    memcpy(frame, m, 9 * sizeof(int16_t));
+    frame[9] = 0;
+
+    doIt(frame, sizeof(frame), 1, f);
+
+    for (int i = 0; i < 9; i++)
+	d[i] = f[i];
 }
 
 void Compensation::loadAccel(json_value& args) {
@@ -271,10 +816,13 @@ void Compensation::loadAccel(json_value& args) {
 	}
 
 	for (int i = 0; i < 3; i++) {
-	    a_offset[i] = j_offset.as_array()[i].as_real();
-	    a_scale[i] = j_scale.as_array()[i].as_real();
+	    a_offset[i] = number(j_offset.as_array()[i]);
+	    a_scale[i] = number(j_scale.as_array()[i]);
 	}
 
+	loadMatrix(args["matrix"], a_matrix);
+	updateCorrection();
+
 	aValid = true;
     } catch (json_error const &e) {
 	std::cout << e.what() << std::endl;
@@ -298,8 +846,15 @@ void Compensation::loadMag(json_value& args) {
 	}
 
 	for (int i = 0; i < 3; i++) {
-	    m_offset[i] = j_offset.as_array()[i].as_real();
-	    m_scale[i] = j_scale.as_array()[i].as_real();
+	    m_offset[i] = number(j_offset.as_array()[i]);
+	    m_scale[i] = number(j_scale.as_array()[i]);
+	}
+
+	loadMatrix(args["matrix"], m_matrix);
+	updateCorrection();
+
+	if (args["error"].is_number()) {
+	    mError = number(args["error"]);
 	}
 
 	mValid = true;
@@ -317,44 +872,128 @@ void Compensation::loadGyro(json_value& args) {
 
     try {
 	for (int i = 0; i < 3; i++) {
-	    g_offset[i] = args.as_array()[i].as_real();
+	    g_offset[i] = number(args.as_array()[i]);
 	}
     } catch (json_error const &e) {
 	std::cout << e.what() << std::endl;
 	gValid = false;
     }
 
+    updateCorrection();
     gValid = true;
 }
 
+void Compensation::loadGyroMatrix(json_value& args) {
+    loadMatrix(args, g_matrix);
+    updateCorrection();
+}
+
+void Compensation::loadTemperature(json_value& args) {
+    tempTable.load(args);
+}
+
+void Compensation::storeTemperature(json_object& args) {
+    tempTable.store(args);
+}
+
+/*
+ * Without the removed part the register values can not be matched with the
+ * full offsets, the entry is ignored then
+ */
+
+void Compensation::loadHardware(json_value& args) {
+    hwValid = false;
+
+    try {
+	auto j_accel = args["accel"];
+	auto j_gyro = args["gyro"];
+	auto j_accel_removed = args["accel_removed"];
+	auto j_gyro_removed = args["gyro_removed"];
+
+	if (!j_accel.is_array() || !j_gyro.is_array() ||
+	    !j_accel_removed.is_array() || !j_gyro_removed.is_array()) {
+	    return;
+	}
+
+	for (int i = 0; i < 3; i++) {
+	    a_hw[i] = j_accel.as_array()[i].as_int();
+	    g_hw[i] = j_gyro.as_array()[i].as_int();
+	    a_removed[i] = number(j_accel_removed.as_array()[i]);
+	    g_removed[i] = number(j_gyro_removed.as_array()[i]);
+	}
+
+	hwValid = true;
+    } catch (json_error const &e) {
+	std::cout << e.what() << std::endl;
+    }
+}
+
+void Compensation::storeHardware(json_object& args) {
+    json_array accel;
+    json_array gyro;
+    json_array accel_removed;
+    json_array gyro_removed;
+
+    if (!hwValid) {
+	return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+	accel.push_back(a_hw[i]);
+	gyro.push_back(g_hw[i]);
+	accel_removed.push_back(a_removed[i]);
+	gyro_removed.push_back(g_removed[i]);
+    }
+
+    args["accel"] = accel;
+    args["gyro"] = gyro;
+    args["accel_removed"] = accel_removed;
+    args["gyro_removed"] = gyro_removed;
+}
+
 void Compensation::storeAccel(json_object& args) {
     json_array offset;
     json_array scale;
 
+    json_array matrix;
+
     for (int i = 0; i < 3; i++) {
-	offset.push_back(a_offset[i]);
+	offset.push_back(a_offset[i] + (hwApplied ? a_removed[i] : 0.0));
 	scale.push_back(a_scale[i]);
     }
 
+    storeMatrix(matrix, a_matrix);
+
     args["offset"] = offset;
     args["scale"] = scale;
+    args["matrix"] = matrix;
 }
 
 void Compensation::storeMag(json_object& args) {
     json_array offset;
     json_array scale;
 
+    json_array matrix;
+
     for (int i = 0; i < 3; i++) {
 	offset.push_back(m_offset[i]);
 	scale.push_back(m_scale[i]);
     }
 
+    storeMatrix(matrix, m_matrix);
+
     args["offset"] = offset;
     args["scale"] = scale;
+    args["matrix"] = matrix;
+    args["error"] = mError;
 }
 
 void Compensation::storeGyro(json_array& args) {
     for (int i = 0; i < 3; i++) {
-	args.push_back(g_offset[i]);
+	args.push_back(g_offset[i] + (hwApplied ? g_removed[i] : 0.0));
     }
 }
+
+void Compensation::storeGyroMatrix(json_array& args) {
+    storeMatrix(args, g_matrix);
+}
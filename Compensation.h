@@ -3,6 +3,11 @@
 
 #include <wampcc/json.h>
 #include <inttypes.h>
+#include <vector>
+
+#include "SeqLock.h"
+#include "EllipsoidFit.h"
+#include "TemperatureTable.h"
 
 using namespace wampcc;
 
@@ -12,21 +17,87 @@ public:
     double	a[3];
     double	g[3];
     double	m[3];
+    double	t = 0.0;
 
     CalibrationItem();
 
-    void set(int16_t m[9]);
+    void set(const int16_t m[10]);
+};
+
+// Compensated sum, stays accurate while values are added and removed for hours
+
+class KahanSum {
+private:
+    double	sum = 0.0;
+    double	c = 0.0;
+
+public:
+    void add(double x);
+    double get() const { return sum; }
+    void clear() { sum = 0.0; c = 0.0; }
+};
+
+// Running sums over the calibration window
+
+class CalibrationStats {
+public:
+    int		n = 0;
+    double	g[3] = { 0, 0, 0 };
+    double	gg[3] = { 0, 0, 0 };
+    double	a[3] = { 0, 0, 0 };
+    double	aa[3] = { 0, 0, 0 };
+    double	aNorm[3] = { 0, 0, 0 };
+    double	t = 0;
+};
+
+/*
+ * Offset, scale, misalignment and unit conversion of one sensor folded into
+ * out = col[0] * x + col[1] * y + col[2] * z + bias. Columns are padded to 4
+ * floats for the SIMD kernels.
+ */
+
+class AffineCorrection {
+public:
+    alignas(16) float	col[3][4];
+    alignas(16) float	bias[4];
+
+    void set(const double offset[3], const double scale[3], const double matrix[3][3], double unit);
+};
+
+class CorrectionSet {
+public:
+    AffineCorrection	accel;
+    AffineCorrection	gyro;
+    AffineCorrection	mag;
 };
 
 class Compensation {
 private:
 
-    static const int	itemsNum = 500/4;
+    int			itemsNum = 500/4;
+
+    /* Owned by the thread calling calibrateItem() */
 
-    CalibrationItem	items[itemsNum];
+    std::vector<CalibrationItem> items;
     int			itemIndex;
+    int			itemsCount;
+
+    double		gSum[3], gSqSum[3];	// raw values are integers, these sums are exact
+    double		aSum[3], aSqSum[3];
+    double		tSum;
+    KahanSum		aNormSum[3];
+
+    /* Owned by the thread calling calibrateMag() */
+
+    EllipsoidFit	magFit;
+    int16_t		magPrev[3];
+    int			magPending;
+
+    SeqLock<CalibrationStats> stats;
+    SeqLock<EllipsoidResult> magResult;
 
     double		gAvr[3];
+    double		tAvr;
     double		gNoise = 100.0;
     bool		gValid = false;
 
@@ -36,14 +107,31 @@ private:
     double		aNoise = 100.0;
     bool		aValid = false;
 
-    double		mAvr[3];
-    double		mMin[3];
-    double		mMax[3];
+    int			mSamples = 0;
+    double		mError = 1.0;
+    double		mRatio = 0.0;
     bool		mValid = false;
 
-    void calcGyroAvr();
-    void calcAccelAvr();
-    void calcMagAvr();
+    void clearWindow();
+    void clearMag();
+    void accumulate(const CalibrationItem &item, double sign);
+    void publishStats();
+
+    double		aUnit = 2.0 / 32768.0;		// g per LSB
+    double		gUnit = 1000.0 / 32768.0;	// deg/s per LSB
+    double		mUnit = 1.0 / 1024.0;
+    double		tUnit = 1.0 / 340.0;		// C per LSB
+    double		tBase = 36.53;			// C at 0 LSB
+
+    TemperatureTable	tempTable;
+    double		aTemp[3] = { 0, 0, 0 };		// accel offset change from tempTable, raw LSB
+
+    SeqLock<CorrectionSet> correction;
+
+    void updateCorrection();
+
+    bool calcGyroAvr(CalibrationStats &s);
+    bool calcAccelAvr(CalibrationStats &s);
 
 public:
     double		aAvr[3];
@@ -54,31 +142,67 @@ public:
     double		m_offset[3];
     double		m_scale[3];
 
+    int16_t		a_hw[3];		// sensor offset registers, see shiftOffsets()
+    int16_t		g_hw[3];
+    double		a_removed[3];		// what they take off the raw data, LSB
+    double		g_removed[3];
+    bool		hwValid = false;
+    bool		hwApplied = false;	// the sensor has them, offsets hold the rest
+
+    double		a_matrix[3][3];		// cross-axis and misalignment
+    double		g_matrix[3][3];
+    double		m_matrix[3][3];
+
     Compensation();
 
-    void calibrateItem(int16_t m[9]);
+    void setUnits(double accel, double gyro, double mag);
+    void setTemperatureUnit(double unit, double base);
+    double getTemperature(int16_t raw) const { return raw * tUnit + tBase; }
+
+    void setWindow(int n);
+    int getWindow() const { return itemsNum; }
+
+    void calibrateItem(const int16_t m[10]);
+    void calibrateMag(const int16_t m[3]);
 
     void clearCalibration();
-    bool calibrated();
+    bool calibrated(bool gyro = true);
+
+    void getWindowStats(CalibrationStats &s) const;
+    bool restoreWindow(const CalibrationStats &s);
+    void getNoise(double &gyro, double &accel) const;
+    void setNoise(double gyro, double accel);
 
     void getGyroSigma(double &x, double &y, double &z, double &r);
     bool calcGyro(double noise);
+    bool trackGyro(double noise, double rate, double gain);
+    bool applyTemperature(double t);
+    void shiftOffsets(const double accel[3], const double gyro[3]);
+    void applyHardware();
 
     void getAccelSigma(double &x, double &y, double &z, double &r);
     void getAccelNorm(double &x, double &y, double &z);
     bool calcAccel(double noise, double angle);
 
-    bool calcMag();
+    void getMagFit(double &error, double &ratio, int &samples);
+    bool calcMag(double error, double ratio);
 
-    void doIt(int16_t m[9], double d[9]);
+    void doIt(const int16_t m[9], double d[9]);
+    void doIt(const int16_t *frames, size_t stride, int count, float *d);
 
     void loadAccel(json_value& args);
     void loadMag(json_value& args);
     void loadGyro(json_value& args);
+    void loadGyroMatrix(json_value& args);
+    void loadTemperature(json_value& args);
+    void loadHardware(json_value& args);
 
     void storeAccel(json_object& args);
     void storeMag(json_object& args);
     void storeGyro(json_array& args);
+    void storeGyroMatrix(json_array& args);
+    void storeTemperature(json_object& args);
+    void storeHardware(json_object& args);
 };
 
 #endif
@@ -2,16 +2,18 @@
 #include <fstream>
 #include <wampcc/json.h>
 #include <unistd.h>
+#include <time.h>
+#include <string.h>
 
 #include "Control.h"
+#include "Checkpoint.h"
 
 #define PI 3.141526
 
 using namespace wampcc;
 
-Control::Control(Compensation *comp, MadgwickAHRS *ahrs) {
+Control::Control(Compensation *comp) : stopping(false) {
     this->comp = comp;
-    this->ahrs = ahrs;
 
     localThread = NULL;
     localSession = NULL;
@@ -61,6 +63,8 @@ void Control::localWork() {
 }
 
 bool Control::loadConfig(std::string filename) {
+    configName = filename;
+
     std::ifstream file(filename, std::ios::binary | std::ios::ate);
 
     if (!file.is_open()) {
@@ -82,6 +86,9 @@ bool Control::loadConfig(std::string filename) {
 	comp->loadAccel(config["accel"]);
 	comp->loadMag(config["mag"]);
 	comp->loadGyro(config["gyro"]);
+	comp->loadGyroMatrix(config["gyro_matrix"]);
+	comp->loadTemperature(config["temperature"]);
+	comp->loadHardware(config["hardware"]);
 
 	delete buf;
 	return true;
@@ -98,14 +105,23 @@ bool Control::storeConfig(std::string filename) {
     json_object	accel;
     json_object	mag;
     json_array	gyro;
+    json_array	gyroMatrix;
+    json_object	temperature;
+    json_object	hardware;
 
     comp->storeAccel(accel);
     comp->storeMag(mag);
     comp->storeGyro(gyro);
+    comp->storeGyroMatrix(gyroMatrix);
+    comp->storeTemperature(temperature);
+    comp->storeHardware(hardware);
 
     config["accel"] = accel;
     config["mag"] = mag;
     config["gyro"] = gyro;
+    config["gyro_matrix"] = gyroMatrix;
+    config["temperature"] = temperature;
+    config["hardware"] = hardware;
 
     std::ofstream file(filename, std::ios::binary | std::ios::ate);
 
@@ -119,16 +135,222 @@ bool Control::storeConfig(std::string filename) {
     return true;
 }
 
+json_value* Control::findOption(const std::string& name) {
+    if (!config.is_object()) {
+	return NULL;
+    }
+
+    auto options = config.as_object().find("options");
+
+    if (options == config.as_object().end() || !options->second.is_object()) {
+	return NULL;
+    }
+
+    auto option = options->second.as_object().find(name);
+
+    if (option == options->second.as_object().end()) {
+	return NULL;
+    }
+
+    return &option->second;
+}
+
+bool Control::getOption(const std::string& name, bool def) {
+    json_value *value = findOption(name);
+
+    if (value && value->is_bool()) {
+	return value->as_bool();
+    }
+
+    return def;
+}
+
+int Control::getOption(const std::string& name, int def) {
+    json_value *value = findOption(name);
+
+    if (value && value->is_int()) {
+	return value->as_int();
+    }
+
+    return def;
+}
+
+double Control::getOption(const std::string& name, double def) {
+    json_value *value = findOption(name);
+
+    if (value && value->is_real()) {
+	return value->as_real();
+    }
+
+    if (value && value->is_int()) {
+	return value->as_int();
+    }
+
+    return def;
+}
+
+std::string Control::getStringOption(const std::string& name, const std::string& def) {
+    json_value *value = findOption(name);
+
+    if (value && value->is_string()) {
+	return value->as_string();
+    }
+
+    return def;
+}
+
+void Control::setFusion(FusionEngine *ahrs) {
+    this->ahrs = ahrs;
+}
+
+void Control::setNavigation(Navigation *nav) {
+    this->nav = nav;
+}
+
+void Control::setSamplingLoop(SamplingLoop *loop) {
+    this->loop = loop;
+}
+
+void Control::setPipeline(RingBase *ring, SamplingLoop *fusionLoop) {
+    this->ring = ring;
+    this->fusionLoop = fusionLoop;
+}
+
+/*
+ * Refines the gyro offset from stationary windows while running. The
+ * samples come from Compensation::calibrateItem() on the fusion side, the
+ * config file is rewritten at most once per interval seconds.
+ */
+
+void Control::setGyroTracking(double noise, double rate, double gain, double interval) {
+    trackNoise = noise;
+    trackRate = rate;
+    trackGain = gain;
+    storeInterval = interval;
+    storeTime = time(NULL);
+    gyroTracking = true;
+}
+
+void Control::trackGyro() {
+    if (!gyroTracking) {
+	return;
+    }
+
+    if (comp->trackGyro(trackNoise, trackRate, trackGain)) {
+	storePending = true;
+    }
+
+    double now = time(NULL);
+
+    if (storePending && now - storeTime >= storeInterval) {
+	storeConfig(configName);
+	storeTime = now;
+	storePending = false;
+    }
+}
+
+/*
+ * Warm start file, rewritten every interval seconds and when stopping
+ */
+
+void Control::setCheckpoint(const std::string& filename, double interval) {
+    checkpointName = filename;
+    checkpointInterval = interval;
+    checkpointTime = time(NULL);
+}
+
+/*
+ * Called before the sampling starts. The window and the noise thresholds
+ * are taken from any checkpoint, the attitude only from one younger than
+ * maxAge seconds.
+ */
+
+bool Control::loadCheckpoint(double maxAge) {
+    CheckpointData	data;
+
+    if (checkpointName.empty() || !::loadCheckpoint(checkpointName.c_str(), data)) {
+	return false;
+    }
+
+    double age = time(NULL) - data.saved;
+
+    comp->setNoise(data.gNoise, data.aNoise);
+    comp->restoreWindow(data.window);
+
+    if (ahrs && data.fusion.seq != 0 && age >= 0 && age <= maxAge) {
+	ahrs->restore(data.fusion);
+    }
+
+    std::cout << "Checkpoint: " << data.engine << ", " << age << " s old" << std::endl;
+    return true;
+}
+
+bool Control::storeCheckpoint() {
+    CheckpointData	data;
+
+    if (checkpointName.empty()) {
+	return false;
+    }
+
+    data.saved = time(NULL);
+
+    if (ahrs) {
+	strncpy(data.engine, ahrs->getName(), sizeof(data.engine) - 1);
+	ahrs->getState(data.fusion);
+    }
+
+    comp->getWindowStats(data.window);
+    comp->getNoise(data.gNoise, data.aNoise);
+
+    return ::storeCheckpoint(checkpointName.c_str(), data);
+}
+
+void Control::checkpoint() {
+    if (checkpointName.empty() || checkpointInterval <= 0) {
+	return;
+    }
+
+    double now = time(NULL);
+
+    if (now - checkpointTime >= checkpointInterval) {
+	storeCheckpoint();
+	checkpointTime = now;
+    }
+}
+
+// Makes work() return after a last checkpoint. Safe from a signal handler.
+
+void Control::stop() {
+    stopping = true;
+}
+
 void Control::publishAngle() {
     double	pitch, roll, yaw;
+    AHRSState	state;
+
+    if (!ahrs || !ahrs->getState(state)) {
+	return;
+    }
+
+    state.getAngles(&roll, &pitch, &yaw);
 
-    ahrs->getAngles(&roll, &pitch, &yaw);
+    if (fusionStart == 0.0) {
+	fusionStart = state.timestamp;
+    }
+
+    if (state.converged && !converged) {
+	converged = true;
+	std::cout << "Fusion: converged in " << state.timestamp - fusionStart << " s" << std::endl;
+    }
 
     json_object opts;
 
     opts["pitch"] = pitch * 180.0 / PI;
     opts["roll"] = roll * 180.0 / PI;
     opts["yaw"] = yaw * 180.0 / PI;
+    opts["time"] = state.timestamp;
+    opts["seq"] = state.seq;
+    opts["converged"] = state.converged;
 
     if (localSession) {
 	localSession->publish("angle", {}, {{ opts }}, {});
@@ -136,22 +358,105 @@ void Control::publishAngle() {
 }
 
 void Control::publishAccel() {
+    AHRSState	state;
+
+    if (!ahrs || !ahrs->getState(state)) {
+	return;
+    }
+
     json_object opts;
 
-    opts["x"] = ahrs->a0 * 1000.0;
-    opts["y"] = ahrs->a1 * 1000.0;
-    opts["z"] = ahrs->a2 * 1000.0;
+    opts["x"] = state.a0 * 1000.0;
+    opts["y"] = state.a1 * 1000.0;
+    opts["z"] = state.a2 * 1000.0;
+    opts["time"] = state.timestamp;
+    opts["seq"] = state.seq;
 
     if (localSession) {
 	localSession->publish("accel", {}, {{ opts }}, {});
     }
 }
 
+void Control::publishNavigation() {
+    NavState	state;
+
+    if (!nav || !nav->getState(state)) {
+	return;
+    }
+
+    json_object opts;
+
+    opts["vx"] = state.v[0];
+    opts["vy"] = state.v[1];
+    opts["vz"] = state.v[2];
+    opts["x"] = state.p[0];
+    opts["y"] = state.p[1];
+    opts["z"] = state.p[2];
+    opts["stationary"] = state.stationary;
+    opts["time"] = state.time;
+    opts["seq"] = state.keyframes;
+
+    if (localSession) {
+	localSession->publish("nav", {}, {{ opts }}, {});
+    }
+}
+
+void Control::publishTiming() {
+    if (!loop) {
+	return;
+    }
+
+    SamplingStats	stats = loop->getStats();
+    json_object		opts;
+
+    opts["ticks"] = stats.ticks;
+    opts["overruns"] = stats.overruns;
+    opts["missed"] = stats.missed;
+    opts["drops"] = stats.drops;
+    opts["lateness"] = stats.lateness / 1000.0;
+    opts["lateness_max"] = stats.maxLateness / 1000.0;
+    opts["work_max"] = stats.maxWork / 1000.0;
+
+    if (localSession) {
+	localSession->publish("timing", {}, {{ opts }}, {});
+    }
+}
+
+void Control::publishPipeline() {
+    if (!ring || !fusionLoop) {
+	return;
+    }
+
+    RingStats		stats = ring->getStats();
+    SamplingStats	fusion = fusionLoop->getStats();
+    json_object		opts;
+
+    opts["capacity"] = stats.capacity;
+    opts["occupancy"] = stats.occupancy;
+    opts["occupancy_max"] = stats.maxOccupancy;
+    opts["pushed"] = stats.pushed;
+    opts["drops"] = stats.drops;
+    opts["fusion_overruns"] = fusion.overruns;
+    opts["fusion_lateness_max"] = fusion.maxLateness / 1000.0;
+    opts["fusion_work_max"] = fusion.maxWork / 1000.0;
+
+    if (localSession) {
+	localSession->publish("pipeline", {}, {{ opts }}, {});
+    }
+}
+
 void Control::work() {
-    while (true) {
+    while (!stopping) {
 	publishAngle();
 	publishAccel();
+	publishNavigation();
+	publishTiming();
+	publishPipeline();
+	trackGyro();
+	checkpoint();
 
 	usleep(1000000/publishFreq);
     }
+
+    storeCheckpoint();
 }
@@ -3,9 +3,13 @@
 
 #include <wampcc/wampcc.h>
 #include <wampcc/json.h>
+#include <atomic>
 
 #include "Compensation.h"
-#include "MadgwickAHRS.h"
+#include "FusionEngine.h"
+#include "Preintegration.h"
+#include "SamplingLoop.h"
+#include "RingBuffer.h"
 
 using namespace wampcc;
 
@@ -19,17 +23,45 @@ private:
     int					publishFreq = 10;
 
     json_value	config;
+    std::string	configName = "imu.json";
+
+    bool	gyroTracking = false;
+    double	trackNoise;
+    double	trackRate;
+    double	trackGain;
+    double	storeInterval;
+    double	storeTime = 0.0;
+    bool	storePending = false;
 
     Compensation *comp;
-    MadgwickAHRS *ahrs;
+    FusionEngine *ahrs = NULL;
+    Navigation	*nav = NULL;
+    double	fusionStart = 0.0;	// time of the first published state
+    bool	converged = false;
+
+    std::string	checkpointName;
+    double	checkpointInterval = 0.0;
+    double	checkpointTime = 0.0;
+    std::atomic<bool> stopping;
+    SamplingLoop *loop = NULL;
+    SamplingLoop *fusionLoop = NULL;
+    RingBase *ring = NULL;
 
     void localWork();
 
+    json_value* findOption(const std::string& name);
+
     void publishAngle();
     void publishAccel();
+    void publishNavigation();
+    void publishTiming();
+    void publishPipeline();
+
+    void trackGyro();
+    void checkpoint();
 
 public:
-    Control(Compensation *comp, MadgwickAHRS *ahrs);
+    Control(Compensation *comp);
     virtual ~Control();
 
     void init();
@@ -37,6 +69,23 @@ public:
 
     bool loadConfig(std::string filename);
     bool storeConfig(std::string filename);
+
+    bool getOption(const std::string& name, bool def);
+    int getOption(const std::string& name, int def);
+    double getOption(const std::string& name, double def);
+    std::string getStringOption(const std::string& name, const std::string& def);
+
+    void setFusion(FusionEngine *ahrs);
+    void setNavigation(Navigation *nav);
+    void setSamplingLoop(SamplingLoop *loop);
+    void setPipeline(RingBase *ring, SamplingLoop *fusionLoop);
+    void setGyroTracking(double noise, double rate, double gain, double interval);
+
+    void setCheckpoint(const std::string& filename, double interval);
+    bool loadCheckpoint(double maxAge);
+    bool storeCheckpoint();
+
+    void stop();
 };
 
 #endif
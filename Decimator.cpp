@@ -0,0 +1,284 @@
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "Decimator.h"
+
+Decimator::Decimator() {
+    reset();
+}
+
+/*
+ * Q15 coefficients with a DC gain of exactly 1, the rounding error goes
+ * to the largest tap. With factor >= 2 no tap is above 0.5, so a pair of
+ * products in _mm_madd_epi16 can not overflow.
+ */
+
+void Decimator::setCoefficients(const double *c, int n) {
+    double	sum = 0;
+    int		total = 0, big = 0;
+
+    taps = n;
+    length = (n + 7) & ~7;
+
+    for (int i = 0; i < n; i++)
+	sum += c[i];
+
+    memset(coeff, 0, sizeof(coeff));
+
+    for (int i = 0; i < n; i++) {
+	int16_t	&k = coeff[length - n + i];
+
+	k = (int16_t) lrint(c[i] / sum * 32768.0);
+	total += k;
+
+	if (fabs(c[i]) > fabs(c[big]))
+	    big = i;
+    }
+
+    coeff[length - n + big] += 32768 - total;
+
+    reset();
+}
+
+/*
+ * Cascade of order boxcars of factor samples, taps = order * (factor - 1) + 1.
+ * Cheap, but the passband droops.
+ */
+
+bool Decimator::setCIC(int factor, int order) {
+    double	c[DECIMATOR_MAX_TAPS] = { 1.0 };
+    int		n = 1;
+
+    if (factor < 2 || order < 1 || order * (factor - 1) + 1 > DECIMATOR_MAX_TAPS) {
+	return false;
+    }
+
+    for (int k = 0; k < order; k++) {
+	double	next[DECIMATOR_MAX_TAPS] = { 0 };
+
+	for (int i = 0; i < n; i++)
+	    for (int j = 0; j < factor; j++)
+		next[i + j] += c[i];
+
+	n += factor - 1;
+	memcpy(c, next, sizeof(c));
+    }
+
+    this->factor = factor;
+    setCoefficients(c, n);
+    return true;
+}
+
+/*
+ * Hamming windowed sinc with the cutoff at 80% of the output Nyquist
+ * frequency, taps is rounded up to odd so the delay is a whole input
+ * sample.
+ */
+
+bool Decimator::setFIR(int factor, int taps) {
+    double	c[DECIMATOR_MAX_TAPS];
+
+    taps |= 1;
+
+    if (factor < 2 || taps < 3 || taps > DECIMATOR_MAX_TAPS) {
+	return false;
+    }
+
+    double	fc = 0.4 / factor;
+    int		m = taps / 2;
+
+    for (int i = 0; i < taps; i++) {
+	double	x = i - m;
+	double	sinc = x == 0 ? 2.0 * fc : sin(2.0 * M_PI * fc * x) / (M_PI * x);
+
+	c[i] = sinc * (0.54 - 0.46 * cos(2.0 * M_PI * i / (taps - 1)));
+    }
+
+    this->factor = factor;
+    setCoefficients(c, taps);
+    return true;
+}
+
+void Decimator::reset() {
+    memset(hist, 0, sizeof(hist));
+
+    for (int i = 0; i < DECIMATOR_MAX_TAPS; i++) {
+	frames[i] = Sample();
+	fresh[i] = 0;
+    }
+
+    freshCount = 0;
+    freshSeen = 0;
+
+    for (int i = 0; i < DECIMATOR_CHANNELS; i++)
+	rest[i] = 0.0;
+
+    for (int i = 0; i < 3; i++) {
+	angle[i] = 0.0;
+	coning[i] = 0.0;
+    }
+
+    pos = 0;
+    filled = 0;
+    phase = 0;
+    lastTime = 0.0;
+    blockTime = 0.0;
+}
+
+// Sum of the window times the coefficients, oldest sample first
+
+int32_t Decimator::dot(const int16_t *x) const {
+#if defined(__SSE2__)
+    __m128i	acc = _mm_setzero_si128();
+
+    for (int i = 0; i < length; i += 8) {
+	__m128i	a = _mm_loadu_si128((const __m128i *) (x + i));
+	__m128i	c = _mm_load_si128((const __m128i *) (coeff + i));
+
+	acc = _mm_add_epi32(acc, _mm_madd_epi16(a, c));
+    }
+
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtsi128_si32(acc);
+#elif defined(__ARM_NEON)
+    int32x4_t	acc = vdupq_n_s32(0);
+
+    for (int i = 0; i < length; i += 8) {
+	int16x8_t	a = vld1q_s16(x + i);
+	int16x8_t	c = vld1q_s16(coeff + i);
+
+	acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(c));
+	acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(c));
+    }
+
+    int32x2_t	s = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+
+    return vget_lane_s32(vpadd_s32(s, s), 0);
+#else
+    int32_t	acc = 0;
+
+    for (int i = 0; i < length; i++)
+	acc += (int32_t) x[i] * coeff[i];
+
+    return acc;
+#endif
+}
+
+/*
+ * Takes one raw sample, returns true when out holds the next decimated
+ * one. The first output waits for a full window. Factor 1 passes the
+ * samples through.
+ */
+
+bool Decimator::push(const Sample &in, Sample &out) {
+    if (factor == 1) {
+	out = in;
+	return true;
+    }
+
+    if (period > 0.0 && lastTime != 0.0 && in.time - lastTime > DECIMATOR_MAX_GAP * period) {
+	reset();
+    }
+
+    for (int ch = 0; ch < DECIMATOR_CHANNELS; ch++) {
+	hist[ch][pos] = in.m[ch];
+	hist[ch][pos + length] = in.m[ch];
+    }
+
+    if (in.magFresh) {
+	freshCount++;
+    }
+
+    frames[pos] = in;
+    fresh[pos] = freshCount;
+
+    pos = (pos + 1) % length;
+
+    /* Coning of the block, from the raw rates */
+
+    double dt = lastTime != 0.0 ? in.time - lastTime : 0.0;
+
+    lastTime = in.time;
+
+    if (gyroScale != 0.0 && dt > 0.0) {
+	double	a[3];
+
+	for (int i = 0; i < 3; i++)
+	    a[i] = in.m[i + 3] * gyroScale * dt;
+
+	coning[0] += 0.5 * (angle[1] * a[2] - angle[2] * a[1]);
+	coning[1] += 0.5 * (angle[2] * a[0] - angle[0] * a[2]);
+	coning[2] += 0.5 * (angle[0] * a[1] - angle[1] * a[0]);
+
+	for (int i = 0; i < 3; i++)
+	    angle[i] += a[i];
+
+	blockTime += dt;
+    }
+
+    if (filled < taps) {
+	filled++;
+    }
+
+    if (++phase < factor) {
+	return false;
+    }
+
+    phase = 0;
+
+    double	extra[DECIMATOR_CHANNELS] = { 0 };
+
+    if (blockTime > 0.0) {
+	for (int i = 0; i < 3; i++)
+	    extra[i + 3] = coning[i] / (gyroScale * blockTime);
+    }
+
+    for (int i = 0; i < 3; i++) {
+	angle[i] = 0.0;
+	coning[i] = 0.0;
+    }
+
+    blockTime = 0.0;
+
+    if (filled < taps) {
+	return false;
+    }
+
+    /* Centre tap, the newest sample is at pos + length - 1 */
+
+    int		centre = (pos + length - 1 - (taps - 1) / 2) % length;
+    int		before = (centre + length - 1) % length;
+
+    out = frames[centre];
+
+    if (!(taps & 1)) {
+	out.time = 0.5 * (frames[centre].time + frames[before].time);
+    }
+
+    out.magFresh = fresh[centre] != freshSeen;
+    freshSeen = fresh[centre];
+
+    for (int ch = 0; ch < DECIMATOR_CHANNELS; ch++) {
+	double	v = dot(&hist[ch][pos]) / 32768.0 + extra[ch] + rest[ch];
+	double	r = rint(v);
+
+	if (r > 32767.0) {
+	    r = 32767.0;
+	} else if (r < -32768.0) {
+	    r = -32768.0;
+	}
+
+	out.m[ch] = (int16_t) r;
+	rest[ch] = fabs(v - r) < 1.0 ? v - r : 0.0;
+    }
+
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <inttypes.h>
+
+#include "Sample.h"
+
+#define DECIMATOR_CHANNELS	6	// accel and gyro words, mag and temperature are passed on
+#define DECIMATOR_MAX_TAPS	64
+#define DECIMATOR_MAX_GAP	4	// raw periods
+
+/*
+ * Oversampling front-end, turns factor raw samples into one at the fusion
+ * rate before Compensation::doIt(). The accel and gyro words go through a
+ * linear phase low-pass FIR, Q15 coefficients on the int16 words with
+ * int32 sums, evaluated once per output only. A CIC filter is the same
+ * FIR with the coefficients of the cascaded boxcars.
+ *
+ * The output time is that of the centre tap, so the group delay of the
+ * filter is already in the timestamps. The mag and temperature words are
+ * those of the centre tap sample too. The gyro gets the coning term of the
+ * raw samples in each block, and the rounding remainder of every word is
+ * carried to the next output, so resolution below 1 LSB is not lost on
+ * average.
+ *
+ * A gap of more than DECIMATOR_MAX_GAP raw periods restarts the filter,
+ * the window and the coning block never span it.
+ */
+
+class Decimator {
+private:
+    int		factor = 1;
+    int		taps = 1;
+    int		length = 8;		// taps padded to the SIMD width, zero coefficients first
+
+    alignas(16) int16_t	coeff[DECIMATOR_MAX_TAPS];
+    int16_t	hist[DECIMATOR_CHANNELS][2 * DECIMATOR_MAX_TAPS];
+    Sample	frames[DECIMATOR_MAX_TAPS];	// time, mag and temperature of the window, by pos
+    unsigned	fresh[DECIMATOR_MAX_TAPS];	// new mag readings up to each of them
+    unsigned	freshCount = 0;
+    unsigned	freshSeen = 0;		// up to the last output
+    int		pos = 0;		// next write, the window starts here
+    int		filled = 0;
+    int		phase = 0;
+
+    double	rest[DECIMATOR_CHANNELS];
+
+    double	period = 0.0;		// raw samples, s, 0 - no gap check
+    double	gyroScale = 0.0;	// rad/s per LSB, 0 - no coning term
+    double	lastTime = 0.0;
+    double	angle[3];		// rotation so far in the block, rad
+    double	coning[3];
+    double	blockTime = 0.0;
+
+    void setCoefficients(const double *c, int n);
+    int32_t dot(const int16_t *x) const;
+
+public:
+    Decimator();
+
+    bool setCIC(int factor, int order);
+    bool setFIR(int factor, int taps);
+    void setGyroScale(double scale) { gyroScale = scale; }
+    void setPeriod(double period) { this->period = period; }
+
+    int getFactor() const { return factor; }
+    double getDelay(double period) const { return (taps - 1) * 0.5 * period; }
+
+    void reset();
+    bool push(const Sample &in, Sample &out);
+};
+
+#endif
@@ -0,0 +1,263 @@
+#include <math.h>
+#include <string.h>
+
+#include "EllipsoidFit.h"
+
+EllipsoidFit::EllipsoidFit() {
+    clear();
+}
+
+void EllipsoidFit::clear() {
+    memset(ata, 0, sizeof(ata));
+    memset(atb, 0, sizeof(atb));
+    n = 0;
+}
+
+void EllipsoidFit::add(double x, double y, double z) {
+    double	p[9];
+
+    x *= norm;
+    y *= norm;
+    z *= norm;
+
+    p[0] = x * x;
+    p[1] = y * y;
+    p[2] = z * z;
+    p[3] = 2.0 * x * y;
+    p[4] = 2.0 * x * z;
+    p[5] = 2.0 * y * z;
+    p[6] = 2.0 * x;
+    p[7] = 2.0 * y;
+    p[8] = 2.0 * z;
+
+    for (int i = 0; i < 9; i++) {
+	for (int j = i; j < 9; j++)
+	    ata[i][j] += p[i] * p[j];
+
+	atb[i] += p[i];
+    }
+
+    n++;
+}
+
+// Solves a x = b for a symmetric positive definite a, upper triangle used
+
+static bool cholesky(double a[9][9], const double b[9], double x[9]) {
+    double	l[9][9];
+    double	y[9];
+
+    memset(l, 0, sizeof(l));
+
+    for (int j = 0; j < 9; j++) {
+	double d = a[j][j];
+
+	for (int k = 0; k < j; k++)
+	    d -= l[j][k] * l[j][k];
+
+	if (d <= 0)
+	    return false;
+
+	l[j][j] = sqrt(d);
+
+	for (int i = j + 1; i < 9; i++) {
+	    double s = a[j][i];
+
+	    for (int k = 0; k < j; k++)
+		s -= l[i][k] * l[j][k];
+
+	    l[i][j] = s / l[j][j];
+	}
+    }
+
+    for (int i = 0; i < 9; i++) {
+	double s = b[i];
+
+	for (int k = 0; k < i; k++)
+	    s -= l[i][k] * y[k];
+
+	y[i] = s / l[i][i];
+    }
+
+    for (int i = 8; i >= 0; i--) {
+	double s = y[i];
+
+	for (int k = i + 1; k < 9; k++)
+	    s -= l[k][i] * x[k];
+
+	x[i] = s / l[i][i];
+    }
+
+    return true;
+}
+
+static bool invert3(const double m[3][3], double r[3][3]) {
+    double det =
+	m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+	m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+	m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+    if (fabs(det) < 1e-12)
+	return false;
+
+    r[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+    r[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+    r[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+    r[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) / det;
+    r[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+    r[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+    r[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) / det;
+    r[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) / det;
+    r[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+
+    return true;
+}
+
+// Jacobi eigen decomposition of a symmetric 3x3 matrix, columns of v are the vectors
+
+static void eigen3(const double m[3][3], double e[3], double v[3][3]) {
+    double a[3][3];
+
+    memcpy(a, m, sizeof(a));
+
+    for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+	    v[i][j] = (i == j) ? 1.0 : 0.0;
+
+    for (int sweep = 0; sweep < 50; sweep++) {
+	double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+
+	if (off < 1e-24)
+	    break;
+
+	for (int p = 0; p < 2; p++)
+	    for (int q = p + 1; q < 3; q++) {
+		if (a[p][q] == 0)
+		    continue;
+
+		double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+		double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+		double c = 1.0 / sqrt(t * t + 1.0);
+		double s = t * c;
+
+		for (int k = 0; k < 3; k++) {
+		    double akp = a[k][p], akq = a[k][q];
+
+		    a[k][p] = c * akp - s * akq;
+		    a[k][q] = s * akp + c * akq;
+		}
+
+		for (int k = 0; k < 3; k++) {
+		    double apk = a[p][k], aqk = a[q][k];
+
+		    a[p][k] = c * apk - s * aqk;
+		    a[q][k] = s * apk + c * aqk;
+		}
+
+		for (int k = 0; k < 3; k++) {
+		    double vkp = v[k][p], vkq = v[k][q];
+
+		    v[k][p] = c * vkp - s * vkq;
+		    v[k][q] = s * vkp + c * vkq;
+		}
+	    }
+    }
+
+    for (int i = 0; i < 3; i++)
+	e[i] = a[i][i];
+}
+
+bool EllipsoidFit::solve(EllipsoidResult &result) const {
+    double	a[9][9];
+    double	p[9];
+
+    result.valid = false;
+    result.samples = n;
+
+    if (n < 9)
+	return false;
+
+    memcpy(a, ata, sizeof(a));
+
+    for (int i = 0; i < 9; i++)
+	a[i][i] += 1e-9 * n;
+
+    if (!cholesky(a, atb, p))
+	return false;
+
+    double m[3][3] = {
+	{ p[0], p[3], p[4] },
+	{ p[3], p[1], p[5] },
+	{ p[4], p[5], p[2] }
+    };
+    double inv[3][3];
+
+    if (!invert3(m, inv))
+	return false;
+
+    double c[3];
+
+    for (int i = 0; i < 3; i++)
+	c[i] = -(inv[i][0] * p[6] + inv[i][1] * p[7] + inv[i][2] * p[8]);
+
+    double k = 1.0;
+
+    for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+	    k += c[i] * m[i][j] * c[j];
+
+    if (k <= 0)
+	return false;
+
+    for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+	    m[i][j] /= k;
+
+    double e[3], v[3][3];
+
+    eigen3(m, e, v);
+
+    if (e[0] <= 0 || e[1] <= 0 || e[2] <= 0)
+	return false;
+
+    // W = V sqrt(E) V^T maps the ellipsoid onto the unit sphere
+
+    for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++) {
+	    double w = 0;
+
+	    for (int l = 0; l < 3; l++)
+		w += v[i][l] * sqrt(e[l]) * v[j][l];
+
+	    result.matrix[i][j] = w * norm;
+	}
+
+    for (int i = 0; i < 3; i++)
+	result.offset[i] = c[i] / norm;
+
+    double emin = e[0], emax = e[0];
+
+    for (int i = 1; i < 3; i++) {
+	if (e[i] < emin) emin = e[i];
+	if (e[i] > emax) emax = e[i];
+    }
+
+    result.ratio = sqrt(emax / emin);
+
+    // Algebraic residual p'Ap - 2p'b + n is sum((x-c)'M(x-c) - k)^2
+
+    double rss = n;
+
+    for (int i = 0; i < 9; i++) {
+	double s = 0;
+
+	for (int j = 0; j < 9; j++)
+	    s += (i <= j ? ata[i][j] : ata[j][i]) * p[j];
+
+	rss += p[i] * s - 2.0 * p[i] * atb[i];
+    }
+
+    result.error = sqrt(rss > 0 ? rss / n : 0) / k / 2.0;
+    result.valid = true;
+
+    return true;
+}
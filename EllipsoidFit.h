@@ -0,0 +1,42 @@
+#ifndef ELLIPSOID_FIT_H
+#define ELLIPSOID_FIT_H
+
+class EllipsoidResult {
+public:
+    bool	valid = false;
+    int		samples = 0;
+    double	offset[3] = { 0, 0, 0 };	// hard iron, raw units
+    double	matrix[3][3];			// soft iron, maps (raw - offset) onto the unit sphere
+    double	error = 1.0;			// RMS radius error, fraction of the field
+    double	ratio = 0.0;			// longest / shortest ellipsoid axis
+};
+
+/*
+ * Online least-squares fit of
+ *
+ *   A x^2 + B y^2 + C z^2 + 2D xy + 2E xz + 2F yz + 2G x + 2H y + 2I z = 1
+ *
+ * Only the normal equations are accumulated, so memory does not depend on
+ * the number of samples, and a partial rotation already constrains the
+ * ellipsoid instead of waiting for every axis extreme.
+ */
+
+class EllipsoidFit {
+private:
+    static constexpr double	norm = 1.0 / 1024.0;	// keeps the normal equations well conditioned
+
+    double	ata[9][9];
+    double	atb[9];
+    int		n;
+
+public:
+    EllipsoidFit();
+
+    void clear();
+    void add(double x, double y, double z);
+    int samples() const { return n; }
+
+    bool solve(EllipsoidResult &result) const;
+};
+
+#endif
@@ -0,0 +1,367 @@
+#include <cmath>
+
+#include "EskfAHRS.h"
+
+#define DEG_TO_RAD 0.0174533
+
+template<typename T>
+Eskf<T>::Eskf(T gyroNoise, T biasNoise, T accelNoise, T magNoise) {
+    gyroVar = gyroNoise * gyroNoise;
+    biasVar = biasNoise * biasNoise;
+    accelVar = accelNoise * accelNoise;
+    magVar = magNoise * magNoise;
+    accelGate = T(0.25);
+
+    /* Some 20 deg of tilt and 0.5 deg/s of bias left over from the calibration */
+
+    Ptt = M3::identity(T(0.1));
+    Ptb = M3::zero();
+    Pbb = M3::identity(T(1e-4));
+
+    bx = T(0);
+    by = T(0);
+    bz = T(0);
+
+    predTime = T(0);
+
+    accelPeriod = T(0);
+    magPeriod = T(0);
+    accelAge = T(0);
+    magAge = T(0);
+    accelCount = 0;
+
+    for (int i = 0; i < 3; i++) {
+	phi[i] = T(0);
+	phiSum[i] = T(0);
+	accelSum[i] = T(0);
+	lastMag[i] = T(0);
+    }
+}
+
+/*
+ * Corrections per second, 0 corrects on every sample (accel) or every
+ * new reading (mag). Accel is averaged over the period.
+ */
+
+template<typename T>
+void Eskf<T>::setRates(T accelRate, T magRate) {
+    accelPeriod = accelRate > T(0) ? T(1) / accelRate : T(0);
+    magPeriod = magRate > T(0) ? T(1) / magRate : T(0);
+}
+
+template<typename T>
+void Eskf<T>::getBias(T *x, T *y, T *z) const {
+    *x = bx;
+    *y = by;
+    *z = bz;
+}
+
+/*
+ * One sample, gyro in rad/s, accel in g. mag is set when mx, my, mz is a
+ * reading the filter has not seen yet.
+ */
+
+template<typename T>
+void Eskf<T>::step(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz, bool mag) {
+    predict(dt, gx - bx, gy - by, gz - bz);
+
+    accelSum[0] += ax;
+    accelSum[1] += ay;
+    accelSum[2] += az;
+    accelCount++;
+    accelAge += dt;
+
+    if (accelAge >= accelPeriod) {
+	T r = T(1) / accelCount;
+
+	correctAccel(accelSum[0] * r, accelSum[1] * r, accelSum[2] * r);
+
+	accelSum[0] = T(0);
+	accelSum[1] = T(0);
+	accelSum[2] = T(0);
+	accelCount = 0;
+	accelAge = T(0);
+    }
+
+    magAge += dt;
+
+    if (mag && magAge >= magPeriod) {
+	correctMag(mx, my, mz);
+	magAge = T(0);
+    }
+}
+
+/*
+ * Nominal quaternion follows the bias corrected rate. The covariance is
+ * left to propagate(), here the rotation of the interval and its time
+ * integral only grow by a few additions.
+ */
+
+template<typename T>
+void Eskf<T>::predict(T dt, T gx, T gy, T gz) {
+    T hx = T(0.5) * dt * gx;
+    T hy = T(0.5) * dt * gy;
+    T hz = T(0.5) * dt * gz;
+    T qa = q0, qb = q1, qc = q2;
+
+    q0 += (-qb * hx - qc * hy - q3 * hz);
+    q1 += (qa * hx + qc * hz - q3 * hy);
+    q2 += (qa * hy - qb * hz + q3 * hx);
+    q3 += (qa * hz + qb * hy - qc * hx);
+
+    T recipNorm = T(1) / std::sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+
+    q0 *= recipNorm;
+    q1 *= recipNorm;
+    q2 *= recipNorm;
+    q3 *= recipNorm;
+
+    phi[0] += gx * dt;
+    phi[1] += gy * dt;
+    phi[2] += gz * dt;
+
+    phiSum[0] += phi[0] * dt;
+    phiSum[1] += phi[1] * dt;
+    phiSum[2] += phi[2] * dt;
+
+    predTime += dt;
+}
+
+/*
+ * Per sample the error evolves with F = [ A -I*dt ; 0 I ], A = I -
+ * skew(w)*dt = Exp(w*dt)^T. Over the interval the product of the A is
+ * Exp(phi)^T, and the bias column is -Exp(phi)^T * (T*I + skew(phiSum)) to
+ * first order in the rotation. The gyro noise on the attitude is isotropic
+ * and keeps its form under rotation, the bias random walk adds the usual
+ * T^3/3, T^2/2 and T terms.
+ */
+
+template<typename T>
+void Eskf<T>::propagate() {
+    T t = predTime;
+
+    if (t <= T(0)) {
+	return;
+    }
+
+    T angle2 = phi[0] * phi[0] + phi[1] * phi[1] + phi[2] * phi[2];
+    T sa, ca;
+
+    /* Series up to some 15 deg, the error is below 1e-6 there */
+
+    if (angle2 < T(0.07)) {
+	sa = T(1) - angle2 / T(6) * (T(1) - angle2 / T(20));
+	ca = T(0.5) - angle2 / T(24) * (T(1) - angle2 / T(30));
+    } else {
+	T angle = std::sqrt(angle2);
+
+	sa = std::sin(angle) / angle;
+	ca = (T(1) - std::cos(angle)) / angle2;
+    }
+
+    M3 S = skew(phi[0], phi[1], phi[2]);
+    M3 Ftt = M3::identity() - S * sa + S * S * ca;
+    M3 Ftb = Ftt * (M3::identity(-t) - skew(phiSum[0], phiSum[1], phiSum[2]));
+
+    M3 FPtb = Ftt * Ptb;
+    M3 cross = FPtb * Ftb.transpose();
+    M3 FPbb = Ftb * Pbb;
+
+    Ptt = symmetric(Ftt * Ptt * Ftt.transpose() + cross + cross.transpose() + FPbb * Ftb.transpose() +
+	M3::identity(gyroVar * t + biasVar * t * t * t / T(3)));
+    Ptb = FPtb + FPbb - M3::identity(biasVar * t * t / T(2));
+    Pbb = Pbb + M3::identity(biasVar * t);
+
+    predTime = T(0);
+
+    for (int i = 0; i < 3; i++) {
+	phi[i] = T(0);
+	phiSum[i] = T(0);
+    }
+}
+
+/*
+ * Measurement y = H * dtheta + noise. Folds the error estimate into the
+ * nominal state and resets it to zero.
+ */
+
+template<typename T>
+template<int M>
+void Eskf<T>::correct(const Matrix<T, M, 3> &H, const Matrix<T, M, 1> &y, T var) {
+    propagate();
+
+    Matrix<T, M, 3> HPtt = H * Ptt;
+    Matrix<T, M, 3> HPtb = H * Ptb;
+    Matrix<T, M, M> S = HPtt * H.transpose() + Matrix<T, M, M>::identity(var);
+    Matrix<T, M, M> Si;
+
+    if (!invert(S, Si)) {
+	return;
+    }
+
+    Matrix<T, 3, M> Kt = HPtt.transpose() * Si;
+    Matrix<T, 3, M> Kb = HPtb.transpose() * Si;
+    Matrix<T, 3, 1> dTheta = Kt * y;
+    Matrix<T, 3, 1> dBias = Kb * y;
+
+    Ptt = symmetric(Ptt - Kt * HPtt);
+    Ptb = Ptb - Kt * HPtb;
+    Pbb = symmetric(Pbb - Kb * HPtb);
+
+    /* q = q * (1, dtheta / 2) */
+
+    T hx = T(0.5) * dTheta(0, 0);
+    T hy = T(0.5) * dTheta(1, 0);
+    T hz = T(0.5) * dTheta(2, 0);
+    T qa = q0, qb = q1, qc = q2;
+
+    q0 += (-qb * hx - qc * hy - q3 * hz);
+    q1 += (qa * hx + qc * hz - q3 * hy);
+    q2 += (qa * hy - qb * hz + q3 * hx);
+    q3 += (qa * hz + qb * hy - qc * hx);
+
+    T recipNorm = T(1) / std::sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+
+    q0 *= recipNorm;
+    q1 *= recipNorm;
+    q2 *= recipNorm;
+    q3 *= recipNorm;
+
+    bx += dBias(0, 0);
+    by += dBias(1, 0);
+    bz += dBias(2, 0);
+}
+
+/*
+ * Direction of gravity in the sensor frame. Averages too far from 1 g are
+ * mostly motion and are skipped.
+ */
+
+template<typename T>
+void Eskf<T>::correctAccel(T ax, T ay, T az) {
+    T norm = std::sqrt(ax * ax + ay * ay + az * az);
+
+    if (std::fabs(norm - T(1)) > accelGate) {
+	return;
+    }
+
+    T gx = T(2) * (q1 * q3 - q0 * q2);
+    T gy = T(2) * (q0 * q1 + q2 * q3);
+    T gz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    Matrix<T, 3, 1> y;
+
+    y(0, 0) = ax / norm - gx;
+    y(1, 0) = ay / norm - gy;
+    y(2, 0) = az / norm - gz;
+
+    correct<3>(skew(gx, gy, gz), y, accelVar);
+}
+
+/*
+ * Heading only: the field is turned to the earth frame with the current
+ * attitude and its horizontal angle is the yaw error. H is the vertical in
+ * the sensor frame, so a tilted field does not pull roll and pitch.
+ */
+
+template<typename T>
+void Eskf<T>::correctMag(T mx, T my, T mz) {
+    T hx = T(2) * (mx * (T(0.5) - q2 * q2 - q3 * q3) + my * (q1 * q2 - q0 * q3) + mz * (q1 * q3 + q0 * q2));
+    T hy = T(2) * (mx * (q1 * q2 + q0 * q3) + my * (T(0.5) - q1 * q1 - q3 * q3) + mz * (q2 * q3 - q0 * q1));
+
+    if (hx == T(0) && hy == T(0)) {
+	return;
+    }
+
+    Matrix<T, 1, 3> H;
+    Matrix<T, 1, 1> y;
+
+    H(0, 0) = -T(2) * (q1 * q3 - q0 * q2);
+    H(0, 1) = -T(2) * (q0 * q1 + q2 * q3);
+    H(0, 2) = -(q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3);
+    y(0, 0) = std::atan2(hy, hx);
+
+    correct<1>(H, y, magVar);
+}
+
+/*
+ * Batch of corrected samples, see Strapdown<T>::batch(). A mag reading is
+ * new when it differs from the last one, doIt() repeats the old one until
+ * the HMC5883L has another.
+ */
+
+template<typename T>
+void Eskf<T>::updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag) {
+    const T toRad = T(DEG_TO_RAD);
+
+    this->batch(samples, data, n, period, mag, [&](T dt, const float *d) {
+	bool fresh = mag && !(d[6] == 0.0f && d[7] == 0.0f && d[8] == 0.0f) &&
+	    (d[6] != lastMag[0] || d[7] != lastMag[1] || d[8] != lastMag[2]);
+
+	if (fresh) {
+	    lastMag[0] = d[6];
+	    lastMag[1] = d[7];
+	    lastMag[2] = d[8];
+	}
+
+	step(dt, d[3] * toRad, d[4] * toRad, d[5] * toRad, d[0], d[1], d[2], d[6], d[7], d[8], fresh);
+    });
+}
+
+template class Eskf<float>;
+template class Eskf<double>;
+
+EskfAHRS::EskfAHRS(double gyroNoise, double biasNoise, double accelNoise, double magNoise,
+		   double accelRate, double magRate)
+    : Eskf<AHRS_SCALAR>(gyroNoise, biasNoise, accelNoise, magNoise) {
+    setRates(accelRate, magRate);
+}
+
+// Fuses a whole batch and publishes once at the end of it
+
+void EskfAHRS::updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag) {
+    if (n == 0) {
+	return;
+    }
+
+    Eskf<AHRS_SCALAR>::updateBatch(samples, data, n, period, mag);
+    publish(timestamp);
+}
+
+void EskfAHRS::setAccelSigma(double x) {
+    Eskf<AHRS_SCALAR>::setAccelSigma(x);
+}
+
+void EskfAHRS::setAlignment(double time, double gain, double tau) {
+    Eskf<AHRS_SCALAR>::setAlignment(time, gain, tau);
+}
+
+void EskfAHRS::restore(const AHRSState &s) {
+    fromState(s);
+}
+
+void EskfAHRS::setIntegration(bool on) {
+    Eskf<AHRS_SCALAR>::setIntegration(on);
+}
+
+bool EskfAHRS::getGyroBias(double b[3]) const {
+    AHRS_SCALAR x, y, z;
+
+    getBias(&x, &y, &z);
+
+    b[0] = x;
+    b[1] = y;
+    b[2] = z;
+    return true;
+}
+
+// Called by the fusion thread after each update. Readers never block it.
+
+void EskfAHRS::publish(double timestamp) {
+    AHRSState s;
+
+    this->timestamp = timestamp;
+
+    toState(s);
+    store(s);
+}
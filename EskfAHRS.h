@@ -0,0 +1,86 @@
+#ifndef ESKF_AHRS_H
+#define ESKF_AHRS_H
+
+#include "FusionEngine.h"
+#include "Matrix.h"
+
+/*
+ * Error state Kalman filter. The nominal state is the quaternion and the
+ * gyro bias, the filter tracks the covariance of their small errors: the
+ * attitude error as a rotation vector in the sensor frame and the bias
+ * error. The quaternion follows the gyro on every sample, the accel and
+ * mag corrections each run at their own rate.
+ *
+ * The covariance is only needed by the corrections, so it is propagated
+ * once per correction: every sample just adds to the rotation and its
+ * time integral over the interval, which give the transition of the whole
+ * interval in closed form. The 6x6 covariance is kept as 3x3 blocks, the
+ * transition matrix is sparse and the measurements only see the attitude,
+ * so no full 6x6 product is ever formed.
+ */
+
+template<typename T>
+class Eskf : public Strapdown<T> {
+protected:
+    typedef Matrix<T, 3, 3> M3;
+
+    using Strapdown<T>::q0;
+    using Strapdown<T>::q1;
+    using Strapdown<T>::q2;
+    using Strapdown<T>::q3;
+
+    M3		Ptt, Ptb, Pbb;	// covariance of attitude, attitude-bias and bias errors
+    T		bx, by, bz;	// gyro bias, rad/s
+
+    T		gyroVar;	// gyro noise, rad^2/s
+    T		biasVar;	// bias random walk, rad^2/s^3
+    T		accelVar;	// direction of the averaged accel, g^2
+    T		magVar;		// heading, rad^2
+    T		accelGate;	// accel averages this far from 1 g are not gravity
+
+    T		predTime;	// since the covariance was last propagated, s
+    T		phi[3];		// rotation over that time, rad
+    T		phiSum[3];	// its time integral, rad*s
+
+    T		accelPeriod, magPeriod;
+    T		accelAge, magAge;	// time since the last correction, s
+    T		accelSum[3];
+    int		accelCount;
+    T		lastMag[3];
+
+    void predict(T dt, T gx, T gy, T gz);
+    void propagate();
+    void correctAccel(T ax, T ay, T az);
+    void correctMag(T mx, T my, T mz);
+
+    template<int M>
+    void correct(const Matrix<T, M, 3> &H, const Matrix<T, M, 1> &y, T var);
+
+public:
+    Eskf(T gyroNoise, T biasNoise, T accelNoise, T magNoise);
+
+    void setRates(T accelRate, T magRate);
+    void getBias(T *x, T *y, T *z) const;
+
+    void step(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz, bool mag);
+    void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag);
+};
+
+class EskfAHRS : public Eskf<AHRS_SCALAR>, public FusionEngine {
+public:
+    EskfAHRS(double gyroNoise, double biasNoise, double accelNoise, double magNoise,
+	     double accelRate, double magRate);
+
+    const char *getName() const { return "eskf"; }
+
+    void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag);
+    void setAccelSigma(double x);
+    void setAlignment(double time, double gain, double tau);
+    void restore(const AHRSState &s);
+    void setIntegration(bool on);
+    bool getGyroBias(double b[3]) const;
+
+    void publish(double timestamp);
+};
+
+#endif
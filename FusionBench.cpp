@@ -0,0 +1,243 @@
+/*
+ * Runs the fusion engines side by side over samples recorded with the
+ * "record" option and prints the time per sample and how far their
+ * angles are apart. The Madgwick bank runs BENCH_LANES copies of the
+ * recording, each starting elsewhere, against as many scalar filters.
+ *
+ *   fusion_bench imu.rec [beta kp ki]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "MadgwickAHRS.h"
+#include "MahonyAHRS.h"
+#include "EskfAHRS.h"
+#include "MadgwickBank.h"
+
+#define BENCH_BATCH 64
+#define BENCH_ROUNDS 20
+#define BENCH_LANES 8
+
+static double time_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Runs the whole recording rounds times on fresh engines, returns ns per
+ * sample of the fastest round, angles of every batch end in out
+ */
+
+template<class Engine, class... Args>
+static double run(const std::vector<Sample> &samples, const std::vector<float> &data,
+		  std::vector<double> &out, Args... args) {
+    double best = 0;
+
+    out.clear();
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+	Engine	engine(args...);
+	size_t	n = samples.size();
+
+	double start = time_ns();
+
+	for (size_t i = 0; i < n; i += BENCH_BATCH) {
+	    size_t	count = n - i < BENCH_BATCH ? n - i : BENCH_BATCH;
+	    AHRSState	state;
+	    double	angles[3];
+
+	    engine.updateBatch(&samples[i], &data[i * 9], count, 0.002, true);
+
+	    if (round == 0) {
+		engine.getState(state);
+		state.getAngles(&angles[0], &angles[1], &angles[2]);
+		out.insert(out.end(), angles, angles + 3);
+	    }
+	}
+
+	double ns = (time_ns() - start) * 1e9 / n;
+
+	if (round == 0 || ns < best)
+	    best = ns;
+    }
+
+    return best;
+}
+
+/*
+ * Lane l sees the recording from sample l * n / lanes on, wrapped around,
+ * so the lanes do not run in step. 9 values per lane and sample.
+ */
+
+static void interleave(const std::vector<float> &data, size_t n, int lanes, std::vector<float> &out) {
+    out.resize(n * lanes * 9);
+
+    for (size_t i = 0; i < n; i++)
+	for (int l = 0; l < lanes; l++) {
+	    size_t src = (i + l * n / lanes) % n;
+
+	    memcpy(&out[(i * lanes + l) * 9], &data[src * 9], 9 * sizeof(float));
+	}
+}
+
+// ns per lane and sample of the fastest round, final quaternions in q
+
+static double runBank(const std::vector<float> &lanes, size_t n, float beta, std::vector<float> &q) {
+    double best = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+	MadgwickBank	bank(BENCH_LANES, beta);
+
+	double start = time_ns();
+
+	for (size_t i = 0; i < n; i++)
+	    bank.update(0.002f, &lanes[i * BENCH_LANES * 9], 9);
+
+	double ns = (time_ns() - start) * 1e9 / (n * BENCH_LANES);
+
+	if (round == 0 || ns < best)
+	    best = ns;
+
+	q.resize(BENCH_LANES * 4);
+
+	for (int l = 0; l < BENCH_LANES; l++)
+	    bank.getQuaternion(l, &q[l * 4]);
+    }
+
+    return best;
+}
+
+static double runScalar(const std::vector<float> &lanes, size_t n, float beta, std::vector<float> &q) {
+    double best = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+	std::vector<Madgwick<float>>	filters(BENCH_LANES, Madgwick<float>(beta));
+
+	double start = time_ns();
+
+	for (size_t i = 0; i < n; i++)
+	    for (int l = 0; l < BENCH_LANES; l++) {
+		const float *d = &lanes[(i * BENCH_LANES + l) * 9];
+
+		filters[l].update(0.002f, d[3], d[4], d[5], d[0], d[1], d[2], d[6], d[7], d[8]);
+	    }
+
+	double ns = (time_ns() - start) * 1e9 / (n * BENCH_LANES);
+
+	if (round == 0 || ns < best)
+	    best = ns;
+
+	q.resize(BENCH_LANES * 4);
+
+	for (int l = 0; l < BENCH_LANES; l++) {
+	    AHRSState	s;
+
+	    filters[l].toState(s);
+	    q[l * 4] = s.q0;
+	    q[l * 4 + 1] = s.q1;
+	    q[l * 4 + 2] = s.q2;
+	    q[l * 4 + 3] = s.q3;
+	}
+    }
+
+    return best;
+}
+
+// Angle difference of two runs, rms and max in deg
+
+static void difference(const std::vector<double> &a, const std::vector<double> &b, double *rms, double *max) {
+    double sum = 0;
+
+    *max = 0;
+
+    for (size_t i = 0; i < a.size(); i++) {
+	double e = fabs(remainder(a[i] - b[i], 2.0 * M_PI)) * 180.0 / M_PI;
+
+	sum += e * e;
+
+	if (e > *max)
+	    *max = e;
+    }
+
+    *rms = sqrt(sum / a.size());
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s imu.rec [beta kp ki]\n", argv[0]);
+	return 1;
+    }
+
+    double beta = argc > 2 ? atof(argv[2]) : 0.3;
+    double kp = argc > 3 ? atof(argv[3]) : 0.5;
+    double ki = argc > 4 ? atof(argv[4]) : 0.0;
+
+    FILE *file = fopen(argv[1], "r");
+
+    if (!file) {
+	perror(argv[1]);
+	return 1;
+    }
+
+    std::vector<Sample>	samples;
+    std::vector<float>	data;
+    Sample		sample;
+    float		d[9];
+
+    while (fscanf(file, "%lf %f %f %f %f %f %f %f %f %f", &sample.time,
+		  &d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7], &d[8]) == 10) {
+	samples.push_back(sample);
+	data.insert(data.end(), d, d + 9);
+    }
+
+    fclose(file);
+
+    if (samples.empty()) {
+	fprintf(stderr, "%s: no samples\n", argv[1]);
+	return 1;
+    }
+
+    std::vector<double>	madgwick, mahony, eskf;
+
+    double tMadgwick = run<MadgwickAHRS>(samples, data, madgwick, beta);
+    double tMahony = run<MahonyAHRS>(samples, data, mahony, kp, ki);
+    double tEskf = run<EskfAHRS>(samples, data, eskf, 0.0005, 0.00002, 0.05, 0.05, 50.0, 25.0);
+
+    std::vector<float>	lanes, qBank, qScalar;
+
+    interleave(data, samples.size(), BENCH_LANES, lanes);
+
+    double tBank = runBank(lanes, samples.size(), beta, qBank);
+    double tScalar = runScalar(lanes, samples.size(), beta, qScalar);
+    double qDiff = 0;
+
+    for (size_t i = 0; i < qBank.size(); i++)
+	if (fabs(qBank[i] - qScalar[i]) > qDiff)
+	    qDiff = fabs(qBank[i] - qScalar[i]);
+
+    double rms, max;
+
+    printf("samples      %zu\n", samples.size());
+    printf("madgwick     %8.1f ns/sample\n", tMadgwick);
+    printf("mahony       %8.1f ns/sample\n", tMahony);
+    printf("eskf         %8.1f ns/sample\n", tEskf);
+    printf("madg float   %8.1f ns/sample, %d filters\n", tScalar, BENCH_LANES);
+    printf("madg bank    %8.1f ns/sample, %d lanes\n", tBank, BENCH_LANES);
+
+    difference(madgwick, mahony, &rms, &max);
+    printf("mahony-madg  %8.3f deg rms, %.3f deg max\n", rms, max);
+
+    difference(madgwick, eskf, &rms, &max);
+    printf("eskf-madg    %8.3f deg rms, %.3f deg max\n", rms, max);
+
+    printf("bank-float   %8.2g max quaternion difference\n", qDiff);
+
+    return 0;
+}
@@ -0,0 +1,384 @@
+#include <cmath>
+
+#include "FusionEngine.h"
+
+#define ALIGN_MOTION		0.1	// g, window average this far from 1 g restarts the alignment
+#define SETTLE_TAU		0.1	// s, smoothing of the residual
+#define CONVERGED_RESIDUAL	0.035	// g, some 2 deg of tilt
+#define RESTORE_TILT		0.985	// cos of the tilt a restored attitude may be off, 10 deg
+#define ALIGN_MAX_TIME		5.0	// s, after this the last window aligns even while moving
+
+void AHRSState::getAngles(double *roll, double *pitch, double *yaw) const {
+    double a12 = 2.0 * (q1 * q2 + q0 * q3);
+    double a22 = q0 * q0 + q1 * q1 - q2 * q2 - q3 * q3;
+    double a31 = 2.0 * (q0 * q1 + q2 * q3);
+    double a32 = 2.0 * (q1 * q3 - q0 * q2);
+    double a33 = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    *roll = atan2(a31, a33);
+    *pitch = -asin(a32);
+    *yaw = atan2(a12, a22);
+}
+
+template<typename T>
+Strapdown<T>::Strapdown() {
+    q0 = 1.0;
+    q1 = 0.0;
+    q2 = 0.0;
+    q3 = 0.0;
+
+    a0 = 0.0;
+    a1 = 0.0;
+    a2 = 0.0;
+
+    v0 = 0.0;
+    v1 = 0.0;
+    v2 = 0.1;
+
+    x = 0;
+    y = 0;
+    z = 0;
+
+    timestamp = 0;
+    aSigma = 0;
+
+    alignTime = T(0.25);
+    alignAge = T(0);
+    alignWait = T(0);
+    alignCount = 0;
+    alignMagCount = 0;
+    alignGain = T(10);
+    boost = T(1);
+    boostTau = T(0.5);
+    residual = T(0);
+    aligned = false;
+    converged = false;
+    restored = false;
+    integrating = true;
+
+    for (int i = 0; i < 6; i++)
+	alignSum[i] = T(0);
+}
+
+/*
+ * The first time seconds of samples are averaged and give the initial
+ * attitude, then the filter gain starts gain times higher and comes down
+ * to its steady value with the time constant tau. Time 0 aligns on the
+ * first sample, gain 1 turns the annealing off. A window off 1 g starts
+ * again, but only for ALIGN_MAX_TIME: under sustained acceleration the last
+ * window is taken as it is and the boosted gain pulls the tilt in.
+ */
+
+template<typename T>
+void Strapdown<T>::setAlignment(T time, T gain, T tau) {
+    alignTime = time;
+    alignGain = gain < T(1) ? T(1) : gain;
+    boostTau = tau;
+}
+
+template<typename T>
+void Strapdown<T>::align(T dt, const float *d, bool mag) {
+    alignSum[0] += d[0];
+    alignSum[1] += d[1];
+    alignSum[2] += d[2];
+    alignCount++;
+
+    if (mag && !(d[6] == 0.0f && d[7] == 0.0f && d[8] == 0.0f)) {
+	alignSum[3] += d[6];
+	alignSum[4] += d[7];
+	alignSum[5] += d[8];
+	alignMagCount++;
+    }
+
+    alignAge += dt;
+    alignWait += dt;
+
+    if (alignAge < alignTime) {
+	return;
+    }
+
+    T ax = alignSum[0] / alignCount;
+    T ay = alignSum[1] / alignCount;
+    T az = alignSum[2] / alignCount;
+    T norm = std::sqrt(ax * ax + ay * ay + az * az);
+
+    if (std::fabs(norm - T(1)) <= T(ALIGN_MOTION) || alignWait >= T(ALIGN_MAX_TIME)) {
+	if (alignMagCount > 0) {
+	    setAttitude(ax, ay, az, alignSum[3] / alignMagCount, alignSum[4] / alignMagCount, alignSum[5] / alignMagCount);
+	} else {
+	    setAttitude(ax, ay, az, T(0), T(0), T(0));
+	}
+
+	aligned = true;
+	boost = alignGain;
+	residual = T(2 * CONVERGED_RESIDUAL);
+	alignWait = T(0);
+    }
+
+    /* Aligned, or moving and the window starts again */
+
+    for (int i = 0; i < 6; i++)
+	alignSum[i] = T(0);
+
+    alignAge = T(0);
+    alignCount = 0;
+    alignMagCount = 0;
+}
+
+/*
+ * Attitude straight from one gravity and one field vector in the sensor
+ * frame (TRIAD): up from the accel, north from the part of the field
+ * across it, west = up x north in this north-west-up frame. Without a field
+ * the yaw is 0.
+ */
+
+template<typename T>
+void Strapdown<T>::setAttitude(T ax, T ay, T az, T mx, T my, T mz) {
+    T r[3][3];
+    T n = T(1) / std::sqrt(ax * ax + ay * ay + az * az);
+
+    r[2][0] = ax * n;
+    r[2][1] = ay * n;
+    r[2][2] = az * n;
+
+    /* West = up x field */
+
+    r[1][0] = r[2][1] * mz - r[2][2] * my;
+    r[1][1] = r[2][2] * mx - r[2][0] * mz;
+    r[1][2] = r[2][0] * my - r[2][1] * mx;
+
+    n = std::sqrt(r[1][0] * r[1][0] + r[1][1] * r[1][1] + r[1][2] * r[1][2]);
+
+    if (n < T(1e-6)) {
+	/* No field, or along the vertical. West from the sensor x axis */
+
+	T wx = T(1) - r[2][0] * r[2][0];
+
+	if (wx > T(0.1)) {
+	    r[1][0] = T(0);
+	    r[1][1] = r[2][2];
+	    r[1][2] = -r[2][1];
+	} else {
+	    r[1][0] = -r[2][2];
+	    r[1][1] = T(0);
+	    r[1][2] = r[2][0];
+	}
+
+	n = std::sqrt(r[1][0] * r[1][0] + r[1][1] * r[1][1] + r[1][2] * r[1][2]);
+    }
+
+    r[1][0] /= n;
+    r[1][1] /= n;
+    r[1][2] /= n;
+
+    /* North = west x up */
+
+    r[0][0] = r[1][1] * r[2][2] - r[1][2] * r[2][1];
+    r[0][1] = r[1][2] * r[2][0] - r[1][0] * r[2][2];
+    r[0][2] = r[1][0] * r[2][1] - r[1][1] * r[2][0];
+
+    /* Rows are the earth axes in the sensor frame, to quaternion */
+
+    T tr = r[0][0] + r[1][1] + r[2][2];
+
+    if (tr > T(0)) {
+	T s = T(2) * std::sqrt(tr + T(1));
+
+	q0 = T(0.25) * s;
+	q1 = (r[2][1] - r[1][2]) / s;
+	q2 = (r[0][2] - r[2][0]) / s;
+	q3 = (r[1][0] - r[0][1]) / s;
+    } else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+	T s = T(2) * std::sqrt(T(1) + r[0][0] - r[1][1] - r[2][2]);
+
+	q0 = (r[2][1] - r[1][2]) / s;
+	q1 = T(0.25) * s;
+	q2 = (r[0][1] + r[1][0]) / s;
+	q3 = (r[0][2] + r[2][0]) / s;
+    } else if (r[1][1] > r[2][2]) {
+	T s = T(2) * std::sqrt(T(1) + r[1][1] - r[0][0] - r[2][2]);
+
+	q0 = (r[0][2] - r[2][0]) / s;
+	q1 = (r[0][1] + r[1][0]) / s;
+	q2 = T(0.25) * s;
+	q3 = (r[1][2] + r[2][1]) / s;
+    } else {
+	T s = T(2) * std::sqrt(T(1) + r[2][2] - r[0][0] - r[1][1]);
+
+	q0 = (r[1][0] - r[0][1]) / s;
+	q1 = (r[0][2] + r[2][0]) / s;
+	q2 = (r[1][2] + r[2][1]) / s;
+	q3 = T(0.25) * s;
+    }
+}
+
+/*
+ * After every aligned sample: the gain boost decays and the accel left
+ * after gravity compensation is smoothed. Once it is small the filter
+ * counts as converged and stays so.
+ */
+
+template<typename T>
+void Strapdown<T>::settle(T dt) {
+    if (boost > T(1)) {
+	T decay = dt < boostTau ? T(1) - dt / boostTau : T(0);
+
+	boost = T(1) + (boost - T(1)) * decay;
+    }
+
+    if (converged) {
+	return;
+    }
+
+    T k = dt < T(SETTLE_TAU) ? dt / T(SETTLE_TAU) : T(1);
+
+    residual += (std::sqrt(a0 * a0 + a1 * a1 + a2 * a2) - residual) * k;
+
+    if (residual < T(CONVERGED_RESIDUAL)) {
+	converged = true;
+    }
+}
+
+template<typename T>
+void Strapdown<T>::getAngles(T *roll, T *pitch, T *yaw) {
+    T a12 = T(2) * (q1 * q2 + q0 * q3);
+    T a22 = q0 * q0 + q1 * q1 - q2 * q2 - q3 * q3;
+    T a31 = T(2) * (q0 * q1 + q2 * q3);
+    T a32 = T(2) * (q1 * q3 - q0 * q2);
+    T a33 = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    *roll = std::atan2(a31, a33);
+    *pitch = -std::asin(a32);
+    *yaw = std::atan2(a12, a22);
+}
+
+template<typename T>
+void Strapdown<T>::gravityCompensate(T ax, T ay, T az) {
+    T g0 = T(2) * (q1 * q3 - q0 * q2);
+    T g1 = T(2) * (q0 * q1 + q2 * q3);
+    T g2 = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    a0 = (ax - g0);
+    a1 = (ay - g1);
+    a2 = (az - g2);
+}
+
+template<typename T>
+void Strapdown<T>::integrate(T dt) {
+    T r = std::sqrt(a0 * a0 + a1 * a1 + a2 * a2);
+
+    if (r > aSigma) {
+	v0 += a0 * dt * T(9.80665);
+	v1 += a1 * dt * T(9.80665);
+	v2 += a2 * dt * T(9.80665);
+    } else {
+	v0 *= T(0.75);
+	v1 *= T(0.75);
+	v2 *= T(0.75);
+    }
+
+    x += v0 * dt;
+    y += v1 * dt;
+    z += v2 * dt;
+}
+
+template<typename T>
+void Strapdown<T>::setAccelSigma(T x) {
+    aSigma = x;
+}
+
+template<typename T>
+void Strapdown<T>::toState(AHRSState &s) const {
+    s.q0 = q0;
+    s.q1 = q1;
+    s.q2 = q2;
+    s.q3 = q3;
+
+    s.a0 = a0;
+    s.a1 = a1;
+    s.a2 = a2;
+
+    s.v0 = v0;
+    s.v1 = v1;
+    s.v2 = v2;
+
+    s.x = x;
+    s.y = y;
+    s.z = z;
+
+    s.timestamp = timestamp;
+    s.converged = converged;
+}
+
+/*
+ * Warm start from a checkpoint, the filter skips the alignment. The
+ * timestamp is not taken, the clock may have started again since.
+ */
+
+template<typename T>
+void Strapdown<T>::fromState(const AHRSState &s) {
+    q0 = s.q0;
+    q1 = s.q1;
+    q2 = s.q2;
+    q3 = s.q3;
+
+    v0 = s.v0;
+    v1 = s.v1;
+    v2 = s.v2;
+
+    x = s.x;
+    y = s.y;
+    z = s.z;
+
+    aligned = true;
+    converged = s.converged;
+    restored = true;
+    boost = T(1);
+    residual = T(0);
+}
+
+/*
+ * The device may have been moved while it was off. When the first sample
+ * is still and its gravity is too far from the restored one, the filter
+ * aligns as on a cold start.
+ */
+
+template<typename T>
+void Strapdown<T>::check(const float *d) {
+    T norm = std::sqrt(T(d[0]) * d[0] + T(d[1]) * d[1] + T(d[2]) * d[2]);
+
+    restored = false;
+
+    if (std::fabs(norm - T(1)) > T(ALIGN_MOTION)) {
+	return;
+    }
+
+    T gx = T(2) * (q1 * q3 - q0 * q2);
+    T gy = T(2) * (q0 * q1 + q2 * q3);
+    T gz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+    if ((d[0] * gx + d[1] * gy + d[2] * gz) / norm < T(RESTORE_TILT)) {
+	aligned = false;
+	converged = false;
+    }
+}
+
+template class Strapdown<float>;
+template class Strapdown<double>;
+
+// Called by the fusion thread after each update. Readers never block it.
+
+void FusionEngine::store(AHRSState &s) {
+    s.seq = ++published;
+    state.store(s);
+}
+
+// Safe from any thread. Returns the sequence number, 0 before the first update.
+
+unsigned long FusionEngine::getState(AHRSState &s) const {
+    if (state.load(s) == 0) {
+	return 0;
+    }
+
+    return s.seq;
+}
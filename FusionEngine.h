@@ -0,0 +1,161 @@
+#ifndef FUSION_ENGINE_H
+#define FUSION_ENGINE_H
+
+#include <stddef.h>
+
+#include "SeqLock.h"
+#include "Sample.h"
+
+// Coherent copy of the filter state for other threads
+
+class AHRSState {
+public:
+    double q0, q1, q2, q3;	// quaternion
+    double a0, a1, a2;		// acceleration
+    double v0, v1, v2;		// velocity
+    double x, y, z;		// pos
+    double timestamp;		// time of the last sample, s
+    unsigned long seq;		// number of published updates
+    bool converged;		// aligned and the tilt agrees with the accel
+
+    void getAngles(double *roll, double *pitch, double *yaw) const;
+};
+
+/*
+ * Orientation quaternion plus the gravity compensation and integration every
+ * filter does the same way. T is the scalar type of the whole update.
+ */
+
+template<typename T>
+class Strapdown {
+protected:
+    T q0, q1, q2, q3;		// quaternion of sensor frame relative to auxiliary frame
+    T aSigma;
+
+    T alignTime, alignAge;	// length of the alignment window, time in it, s
+    T alignWait;		// time since the alignment started, s
+    T alignSum[6];		// accel and mag over the window
+    int alignCount, alignMagCount;
+    T alignGain;		// gain multiplier right after the alignment
+    T boost;			// current multiplier, anneals to 1
+    T boostTau;			// time constant of the annealing, s
+    T residual;			// smoothed accel left after gravity, g
+    bool aligned, converged;
+    bool restored;		// attitude from a checkpoint, not checked yet
+    bool integrating;		// velocity and position per sample
+
+    void align(T dt, const float *d, bool mag);
+    void settle(T dt);
+    void check(const float *d);
+
+    template<class Step>
+    void batch(const Sample *samples, const float *data, size_t n, double period, bool mag, Step step);
+
+public:
+    T a0, a1, a2;		// acceleration
+    T v0, v1, v2;		// velocity;
+    T x, y, z;			// pos;
+    double timestamp;		// time of the last sample, s
+
+    Strapdown();
+
+    void getAngles(T *roll, T *pitch, T *yaw);
+    void gravityCompensate(T ax, T ay, T az);
+    void integrate(T dt);
+
+    void setAccelSigma(T x);
+    void setAlignment(T time, T gain, T tau);
+    void setIntegration(bool on) { integrating = on; }
+    void setAttitude(T ax, T ay, T az, T mx, T my, T mz);
+    bool isConverged() const { return converged; }
+
+    void toState(AHRSState &s) const;
+    void fromState(const AHRSState &s);
+};
+
+/*
+ * Batch of corrected samples, data holds 9 values per sample as from
+ * Compensation::doIt(): accel in g, gyro in deg/s, mag. The step is taken
+ * from the sample timestamps, the nominal period is used for the first
+ * sample and after a stall. Until the alignment is done the samples only
+ * go to align(), after it step(dt, d) runs the filter update, then
+ * gravity compensation and integration follow. A restored attitude is
+ * checked against the first sample. The integration is off when the
+ * navigation runs on preintegrated keyframes instead.
+ */
+
+template<typename T>
+template<class Step>
+void Strapdown<T>::batch(const Sample *samples, const float *data, size_t n, double period, bool mag, Step step) {
+    const double	maxStep = period * 10.0;
+    double		last = timestamp;
+
+    for (size_t i = 0; i < n; i++) {
+	const float * __restrict d = data + i * 9;
+	double	dt = samples[i].time - last;
+
+	if (last == 0.0 || dt <= 0.0 || dt > maxStep) {
+	    dt = period;
+	}
+
+	last = samples[i].time;
+
+	if (restored) {
+	    check(d);
+	}
+
+	if (!aligned) {
+	    align(T(dt), d, mag);
+	    continue;
+	}
+
+	step(T(dt), d);
+	gravityCompensate(d[0], d[1], d[2]);
+
+	if (integrating) {
+	    integrate(T(dt));
+	}
+
+	settle(T(dt));
+    }
+
+    timestamp = last;
+}
+
+// Scalar type of the engines, e.g. -DAHRS_SCALAR=float for targets with slow double
+
+#ifndef AHRS_SCALAR
+#define AHRS_SCALAR double
+#endif
+
+/*
+ * What main and Control see of a filter. The fusion thread feeds batches,
+ * any other thread reads the published state. getGyroBias() is the bias
+ * the filter estimated on top of the compensation, rad/s, false for
+ * filters without one. Fusion thread only.
+ */
+
+class FusionEngine {
+private:
+    SeqLock<AHRSState>	state;
+    unsigned long	published = 0;
+
+protected:
+    void store(AHRSState &s);
+
+public:
+    virtual ~FusionEngine() {}
+
+    virtual const char *getName() const = 0;
+
+    virtual void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag) = 0;
+    virtual void setAccelSigma(double x) = 0;
+    virtual void setAlignment(double time, double gain, double tau) = 0;
+    virtual void restore(const AHRSState &s) = 0;
+    virtual void setIntegration(bool on) = 0;
+    virtual bool getGyroBias(double b[3]) const = 0;
+
+    unsigned long getState(AHRSState &s) const;
+};
+
+#endif
@@ -284,6 +284,51 @@ namespace cacaosd_hmc5883l {
         return i2c->readWord(Z_HIGH, Z_LOW);
     }
 
+/** Get all axes of one measurement.
+ * The six data registers and STATUS_REG are read in one transaction, the
+ * data first. Reading the data registers completely releases the lock and
+ * guarantees that all axes come from one measurement, so LOCK is clear in
+ * the status. RDY stays high until the next measurement is being written,
+ * it does not tell a new reading from one already read. The caller has to
+ * track that, e.g. RDY having been low since the last read or the data
+ * having changed.
+ * @param mag X/Y/Z heading measurement, zeros if the read failed
+ * @return STATUS_REG value, 0 if the read failed
+ * @see X_HIGH
+ * @see STATUS_REG
+ */
+    uint8_t HMC5883L::getMagnitudes(int16_t *mag) const {
+        uint8_t status = 0;
+        uint8_t data[6] = {0, 0, 0, 0, 0, 0};
+
+        const uint8_t regs[2] = {X_HIGH, STATUS_REG};
+        uint8_t *buffers[2] = {data, &status};
+        const uint16_t lengths[2] = {6, 1};
+
+        if (!i2c->readRegisterBlocks(regs, buffers, lengths, 2)) {
+            status = 0;
+        }
+
+        mag[0] = (int16_t) (((uint16_t) data[0] << 8) | data[1]);
+        mag[2] = (int16_t) (((uint16_t) data[2] << 8) | data[3]);
+        mag[1] = (int16_t) (((uint16_t) data[4] << 8) | data[5]);
+
+        return status;
+    }
+
+/** Reorder raw data registers into axes.
+ * Converts words read starting at X_HIGH by another master (X, Z, Y register
+ * order) into X, Y, Z.
+ * @param mag Data words, reordered in place
+ * @see X_HIGH
+ */
+    void HMC5883L::orderMagnitudes(int16_t *mag) {
+        int16_t z = mag[1];
+
+        mag[1] = mag[2];
+        mag[2] = z;
+    }
+
 /** Get data ready status.
  * This bit is set when data is written to all six data registers, and cleared
  * when the device initiates a write to the data output registers and after one
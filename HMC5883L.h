@@ -120,6 +120,10 @@ namespace cacaosd_hmc5883l {
 
         int16_t getMagnitudeZ() const;
 
+        uint8_t getMagnitudes(int16_t *mag) const;
+
+        static void orderMagnitudes(int16_t *mag);
+
         uint8_t getRDYStatus() const;
 
         uint8_t getLockStatus() const;
@@ -24,6 +24,7 @@ namespace cacaosd_i2cport {
  */
     I2cPort::I2cPort() {
         this->connection_open = false;
+        this->combined_transfer = false;
     }
 
 /**
@@ -32,6 +33,7 @@ namespace cacaosd_i2cport {
  */
     I2cPort::I2cPort(uint8_t bus_address) {
         this->connection_open = false;
+        this->combined_transfer = false;
         this->bus_address = bus_address;
         this->path = (char *) calloc(PATH_SIZE, sizeof(char));
         sprintf(path, "/dev/i2c-%d", this->bus_address);
@@ -44,6 +46,7 @@ namespace cacaosd_i2cport {
  */
     I2cPort::I2cPort(uint8_t device_address, uint8_t bus_address) {
         this->connection_open = false;
+        this->combined_transfer = false;
         this->bus_address = bus_address;
         this->path = (char *) calloc(PATH_SIZE, sizeof(char));
         this->device_address = device_address;
@@ -116,6 +119,15 @@ namespace cacaosd_i2cport {
             msg_error("Connection was not established.");
             exit(1);
         }
+        unsigned long funcs = 0;
+
+        if (ioctl(file, I2C_FUNCS, &funcs) == 0 && (funcs & I2C_FUNC_I2C)) {
+            this->combined_transfer = true;
+        } else {
+            this->combined_transfer = false;
+            msg_warning("Combined transfers are not supported. Address %d.", device_address);
+        }
+
         this->connection_open = true;
         this->file_descriptor = file;
     }
@@ -126,6 +138,7 @@ namespace cacaosd_i2cport {
  */
     void I2cPort::closeConnection() {
         this->connection_open = false;
+        this->combined_transfer = false;
         close(this->file_descriptor);
     }
 
@@ -282,18 +295,9 @@ namespace cacaosd_i2cport {
  */
     uint8_t I2cPort::readByte(uint8_t DATA_REGADD) {
 
-        uint8_t buffer[1];
-        buffer[0] = DATA_REGADD;
-
-        if (write(this->file_descriptor, buffer, 1) != 1) {
-            msg_error("Can not write data. Address %d.", device_address);
-        }
+        uint8_t value[1] = {0};
 
-        uint8_t value[1];
-
-        if (read(this->file_descriptor, value, 1) != 1) {
-            msg_error("Can not read data. Address %d.", device_address);
-        }
+        readRegisters(DATA_REGADD, value, 1);
 
         return value[0];
     }
@@ -308,16 +312,7 @@ namespace cacaosd_i2cport {
     void I2cPort::readByteBuffer(uint8_t DATA_REGADD, uint8_t *data,
                                  uint8_t length) {
 
-        uint8_t buffer[1];
-        buffer[0] = DATA_REGADD;
-
-        if (write(this->file_descriptor, buffer, 1) != 1) {
-            msg_error("Can not write data. Address %d.", device_address);
-        }
-
-        if (read(this->file_descriptor, data, length) != length) {
-            msg_error("Can not read data. Address %d.", device_address);
-        }
+        readRegisters(DATA_REGADD, data, length);
 
     }
 
@@ -343,11 +338,141 @@ namespace cacaosd_i2cport {
  */
     int16_t I2cPort::readWord(uint8_t MSB, uint8_t LSB) {
 
-        uint8_t msb = readByte(MSB);
+        uint8_t msb, lsb;
+
+        if (LSB == MSB + 1) {
+            uint8_t value[2] = {0, 0};
 
-        uint8_t lsb = readByte(LSB);
+            readRegisters(MSB, value, 2);
+
+            msb = value[0];
+            lsb = value[1];
+        } else {
+            msb = readByte(MSB);
+            lsb = readByte(LSB);
+        }
 
         return ((int16_t) msb << 8) + lsb;
     }
 
+/**
+ * Read consecutive registers starting at DATA_REGADD. When the adapter
+ * supports plain I2C messages the register address write and the data read
+ * are issued as one I2C_RDWR transaction with a repeated start, otherwise
+ * it falls back to a separate write() and read().
+ * @function readRegisters(uint8_t DATA_REGADD, uint8_t *data, uint16_t length)
+ * @param DATA_REGADD First Data Register Address.
+ * @param data Data storage array.
+ * @param length Array length.
+ * @return true on success.
+ */
+    bool I2cPort::readRegisters(uint8_t DATA_REGADD, uint8_t *data,
+                                uint16_t length) {
+
+        uint8_t buffer[1];
+        buffer[0] = DATA_REGADD;
+
+        if (this->combined_transfer) {
+            struct i2c_msg msgs[2];
+
+            msgs[0].addr = device_address;
+            msgs[0].flags = 0;
+            msgs[0].len = 1;
+            msgs[0].buf = buffer;
+
+            msgs[1].addr = device_address;
+            msgs[1].flags = I2C_M_RD;
+            msgs[1].len = length;
+            msgs[1].buf = data;
+
+            if (transfer(msgs, 2)) {
+                return true;
+            }
+
+            msg_error("Can not transfer data. Address %d.", device_address);
+            return false;
+        }
+
+        if (write(this->file_descriptor, buffer, 1) != 1) {
+            msg_error("Can not write data. Address %d.", device_address);
+            return false;
+        }
+
+        if (read(this->file_descriptor, data, length) != length) {
+            msg_error("Can not read data. Address %d.", device_address);
+            return false;
+        }
+
+        return true;
+    }
+
+/**
+ * Read several non-contiguous register blocks. With combined transfers all
+ * blocks are read in one I2C_RDWR transaction, so nothing else can touch the
+ * device between them.
+ * @function readRegisterBlocks(const uint8_t *DATA_REGADD, uint8_t **data, const uint16_t *length, uint8_t count)
+ * @param DATA_REGADD First Data Register Address of every block.
+ * @param data Data storage array of every block.
+ * @param length Array length of every block.
+ * @param count Blocks count, up to MAX_REGISTER_BLOCKS.
+ * @return true on success.
+ */
+    bool I2cPort::readRegisterBlocks(const uint8_t *DATA_REGADD, uint8_t **data,
+                                     const uint16_t *length, uint8_t count) {
+
+        if (count > MAX_REGISTER_BLOCKS) {
+            msg_error("Too many register blocks. Address %d.", device_address);
+            return false;
+        }
+
+        if (this->combined_transfer) {
+            struct i2c_msg msgs[MAX_REGISTER_BLOCKS * 2];
+            uint8_t buffer[MAX_REGISTER_BLOCKS];
+
+            for (uint8_t i = 0; i < count; i++) {
+                buffer[i] = DATA_REGADD[i];
+
+                msgs[i * 2].addr = device_address;
+                msgs[i * 2].flags = 0;
+                msgs[i * 2].len = 1;
+                msgs[i * 2].buf = &buffer[i];
+
+                msgs[i * 2 + 1].addr = device_address;
+                msgs[i * 2 + 1].flags = I2C_M_RD;
+                msgs[i * 2 + 1].len = length[i];
+                msgs[i * 2 + 1].buf = data[i];
+            }
+
+            if (transfer(msgs, count * 2)) {
+                return true;
+            }
+
+            msg_error("Can not transfer data. Address %d.", device_address);
+            return false;
+        }
+
+        for (uint8_t i = 0; i < count; i++) {
+            if (!readRegisters(DATA_REGADD[i], data[i], length[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+/**
+ * @function transfer(struct i2c_msg *msgs, uint32_t count)
+ * @param msgs Messages sent as one combined transaction.
+ * @param count Messages count.
+ * @return true on success.
+ */
+    bool I2cPort::transfer(struct i2c_msg *msgs, uint32_t count) {
+        struct i2c_rdwr_ioctl_data rdwr;
+
+        rdwr.msgs = msgs;
+        rdwr.nmsgs = count;
+
+        return ioctl(this->file_descriptor, I2C_RDWR, &rdwr) == (int) count;
+    }
+
 }  // namespace cacaosd_i2cport
@@ -22,12 +22,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #define PATH_SIZE 15
+#define MAX_REGISTER_BLOCKS 4
 
 #define msg_error(M, ...) printf("[ERROR]:" M "\n", ##__VA_ARGS__);
 #define msg_warning(M, ...) printf("[WARNING]:" M "\n", ##__VA_ARGS__);
@@ -87,7 +89,14 @@ namespace cacaosd_i2cport {
 
         int16_t readWord(uint8_t MSB, uint8_t LSB);
 
+        bool readRegisters(uint8_t DATA_REGADD, uint8_t *data, uint16_t length);
 
+        bool readRegisterBlocks(const uint8_t *DATA_REGADD, uint8_t **data,
+                                const uint16_t *length, uint8_t count);
+
+        bool isCombinedTransfer() const {
+            return combined_transfer;
+        }
 
     private:
         int file_descriptor;
@@ -95,6 +104,9 @@ namespace cacaosd_i2cport {
         uint8_t device_address;
         char *path;
         bool connection_open;
+        bool combined_transfer;
+
+        bool transfer(struct i2c_msg *msgs, uint32_t count);
 
     };
 }  // namespace cacaosd_i2cport
@@ -15,12 +15,18 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
+
 #include "MPU6050.h"
 
 namespace cacaosd_mpu6050 {
 
     MPU6050::MPU6050(I2cPort *i2c) {
         this->i2c = i2c;
+        this->fifo_frame_length = 0;
+        this->fifo_temperature = false;
+        this->fifo_auxiliary = false;
+        this->aux_length = 0;
     }
 
     MPU6050::~MPU6050() {
@@ -187,10 +193,22 @@ namespace cacaosd_mpu6050 {
         return fs;
     }
 
-    void MPU6050::getAccelerations(int16_t *accels) {
-        accels[0] = i2c->readWord(ACCEL_XOUT_H, ACCEL_XOUT_L);
-        accels[1] = i2c->readWord(ACCEL_YOUT_H, ACCEL_YOUT_L);
-        accels[2] = i2c->readWord(ACCEL_ZOUT_H, ACCEL_ZOUT_L);
+    static inline int16_t decodeWord(const uint8_t *buffer) {
+        return (int16_t) (((uint16_t) buffer[0] << 8) | buffer[1]);
+    }
+
+    bool MPU6050::getAccelerations(int16_t *accels) {
+        uint8_t buffer[6];
+
+        if (!i2c->readRegisters(ACCEL_XOUT_H, buffer, 6)) {
+            return false;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            accels[i] = decodeWord(&buffer[i * 2]);
+        }
+
+        return true;
     }
 
     int16_t MPU6050::getAccelerationX() {
@@ -205,10 +223,18 @@ namespace cacaosd_mpu6050 {
         return i2c->readWord(ACCEL_ZOUT_H, ACCEL_ZOUT_L);
     }
 
-    void MPU6050::getAngularVelocities(int16_t *gyros) {
-        gyros[0] = i2c->readWord(GYRO_XOUT_H, GYRO_XOUT_L);
-        gyros[1] = i2c->readWord(GYRO_YOUT_H, GYRO_YOUT_L);
-        gyros[2] = i2c->readWord(GYRO_ZOUT_H, GYRO_ZOUT_L);
+    bool MPU6050::getAngularVelocities(int16_t *gyros) {
+        uint8_t buffer[6];
+
+        if (!i2c->readRegisters(GYRO_XOUT_H, buffer, 6)) {
+            return false;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            gyros[i] = decodeWord(&buffer[i * 2]);
+        }
+
+        return true;
     }
 
     int16_t MPU6050::getAngularVelocityX() {
@@ -227,14 +253,92 @@ namespace cacaosd_mpu6050 {
         return i2c->readWord(TEMP_OUT_H, TEMP_OUT_L);
     }
 
-    void MPU6050::getMotions6(int16_t *motion6) {
-        motion6[0] = i2c->readWord(ACCEL_XOUT_H, ACCEL_XOUT_L);
-        motion6[1] = i2c->readWord(ACCEL_YOUT_H, ACCEL_YOUT_L);
-        motion6[2] = i2c->readWord(ACCEL_ZOUT_H, ACCEL_ZOUT_L);
+/** Get accelerations and angular velocities.
+ * Reads ACCEL_XOUT_H through GYRO_ZOUT_L in a single burst.
+ * @param motion6 Accel X/Y/Z followed by gyro X/Y/Z
+ * @return false if the transfer failed, motion6 is left untouched then
+ * @see getMotions7()
+ */
+    bool MPU6050::getMotions6(int16_t *motion6) {
+        int16_t motion7[7];
+
+        if (!getMotions7(motion7)) {
+            return false;
+        }
+
+        for (int i = 0; i < 6; i++) {
+            motion6[i] = motion7[i];
+        }
+
+        return true;
+    }
+
+/** Get accelerations, angular velocities and temperature.
+ * @param motion7 Accel X/Y/Z, gyro X/Y/Z, temperature
+ * @return false if the transfer failed, motion7 is left untouched then
+ * @see getMotionsBurst()
+ */
+    bool MPU6050::getMotions7(int16_t *motion7) {
+        uint8_t buffer[MOTION_BURST_LENGTH];
+
+        if (!getMotionsBurst(buffer)) {
+            return false;
+        }
+
+        decodeMotions(buffer, motion7);
+        return true;
+    }
+
+/** Read the raw sensor registers.
+ * All 14 bytes from ACCEL_XOUT_H to GYRO_ZOUT_L are read in one transaction,
+ * so accel, temperature and gyro belong to the same sample.
+ * @param buffer Storage of MOTION_BURST_LENGTH bytes
+ * @return false if the transfer failed, buffer holds no sample then
+ * @see ACCEL_XOUT_H
+ */
+    bool MPU6050::getMotionsBurst(uint8_t *buffer) {
+        return i2c->readRegisters(ACCEL_XOUT_H, buffer, MOTION_BURST_LENGTH);
+    }
+
+/** Get one complete frame from the sensor registers.
+ * Accel, temperature, gyro and the auxiliary sensor data (see
+ * setupAuxiliaryRead()) are read in one burst starting at ACCEL_XOUT_H.
+ * @param frame FIFO_FRAME_WORDS words, same layout as readFIFO_Frames()
+ * @return false if the transfer failed, frame is left untouched then
+ */
+    bool MPU6050::getMotionFrame(int16_t *frame) {
+        uint8_t buffer[MOTION_BURST_LENGTH + AUX_MAX_LENGTH];
+        int16_t motion7[7];
+
+        if (!i2c->readRegisters(ACCEL_XOUT_H, buffer, MOTION_BURST_LENGTH + aux_length)) {
+            return false;
+        }
+
+        decodeMotions(buffer, motion7);
+
+        for (int i = 0; i < 6; i++) {
+            frame[i] = motion7[i];
+        }
+
+        for (int i = 0; i < 3; i++) {
+            frame[6 + i] = (i * 2 < aux_length) ? decodeWord(&buffer[MOTION_BURST_LENGTH + i * 2]) : 0;
+        }
+
+        frame[9] = motion7[6];
+        return true;
+    }
+
+/** Decode a raw burst into big-endian words.
+ * @param buffer MOTION_BURST_LENGTH bytes as read by getMotionsBurst()
+ * @param motion7 Accel X/Y/Z, gyro X/Y/Z, temperature
+ */
+    void MPU6050::decodeMotions(const uint8_t *buffer, int16_t *motion7) {
+        for (int i = 0; i < 3; i++) {
+            motion7[i] = decodeWord(&buffer[i * 2]);
+            motion7[i + 3] = decodeWord(&buffer[8 + i * 2]);
+        }
 
-        motion6[3] = i2c->readWord(GYRO_XOUT_H, GYRO_XOUT_L);
-        motion6[4] = i2c->readWord(GYRO_YOUT_H, GYRO_YOUT_L);
-        motion6[5] = i2c->readWord(GYRO_ZOUT_H, GYRO_ZOUT_L);
+        motion7[6] = decodeWord(&buffer[6]);
     }
 
 /** Set digital low-pass filter configuration.
@@ -420,8 +524,8 @@ namespace cacaosd_mpu6050 {
         return i2c->readBit(USER_CTRL, FIFO_EN_BIT);
     }
 
-    void MPU6050::getFIFO_Data(uint8_t *data, uint8_t length) {
-        i2c->readByteBuffer(FIFO_R_W, data, length);
+    bool MPU6050::getFIFO_Data(uint8_t *data, uint8_t length) {
+        return i2c->readRegisters(FIFO_R_W, data, length);
     }
 
     void MPU6050::setFIFO_Reset(uint8_t value) {
@@ -432,4 +536,368 @@ namespace cacaosd_mpu6050 {
         return i2c->readBit(USER_CTRL, FIFO_RESET_BIT);
     }
 
+/** Get FIFO overflow interrupt status.
+ * Reading INT_STATUS clears the flag.
+ * @return 1 if the FIFO overflowed since the last read
+ * @see INT_STATUS
+ * @see FIFO_OFLOW_INT_BIT
+ */
+    uint8_t MPU6050::getFIFO_Overflow() {
+        return i2c->readBit(INT_STATUS, FIFO_OFLOW_INT_BIT);
+    }
+
+/** Route accel and gyro (and optionally temperature) samples into the FIFO.
+ * Every sample produced at the configured sample rate is pushed into the FIFO
+ * as one frame, which can later be drained in bulk by readFIFO_Frames().
+ * @param temperature Also store the temperature in every frame
+ * @param auxiliary Also store the I2C_SLV0 data in every frame
+ * @see FIFO_EN
+ * @see readFIFO_Frames()
+ * @see setupAuxiliaryRead()
+ */
+    void MPU6050::setupFIFO(bool temperature, bool auxiliary) {
+        setFIFO_Enable(0);
+
+        uint8_t fifo_en = (1 << XG_FIFO_EN_BIT) | (1 << YG_FIFO_EN_BIT) |
+                          (1 << ZG_FIFO_EN_BIT) | (1 << ACCEL_FIFO_EN_BIT);
+
+        if (temperature) {
+            fifo_en |= (1 << TEMP_FIFO_EN_BIT);
+        }
+
+        if (auxiliary && aux_length > 0) {
+            fifo_en |= (1 << SLV0_FIFO_EN_BIT);
+        } else {
+            auxiliary = false;
+        }
+
+        i2c->writeByte(FIFO_EN, fifo_en);
+
+        this->fifo_temperature = temperature;
+        this->fifo_auxiliary = auxiliary;
+        this->fifo_frame_length = (temperature ? 14 : 12) + (auxiliary ? aux_length : 0);
+
+        resetFIFO();
+    }
+
+/** Drop the FIFO content and restart filling it on a frame boundary.
+ * @see FIFO_RESET_BIT
+ */
+    void MPU6050::resetFIFO() {
+        setFIFO_Enable(0);
+        setFIFO_Reset(1);
+        getFIFO_Overflow();
+        setFIFO_Enable(1);
+    }
+
+/** Get the length of one FIFO frame in bytes.
+ * @return frame length, 0 if the FIFO was not set up
+ */
+    uint8_t MPU6050::getFIFO_FrameLength() const {
+        return this->fifo_frame_length;
+    }
+
+/** Get the period between two samples.
+ * Sample Rate = Gyroscope Output Rate / (1 + SMPLRT_DIV)
+ * @return sample period in seconds
+ * @see getSampleRate()
+ * @see getDLPFMode()
+ */
+    double MPU6050::getSamplePeriod() {
+        uint8_t mode = getDLPFMode();
+        double output_rate = (mode == 0 || mode == 7) ? 8000.0 : 1000.0;
+
+        return (1.0 + getSampleRate()) / output_rate;
+    }
+
+/** Get the gyroscope delay of the configured DLPF mode.
+ * Samples leave the sensor this late compared to the motion they describe.
+ * @return delay in seconds
+ * @see getDLPFMode()
+ */
+    double MPU6050::getGroupDelay() {
+        static const double delay[8] = {
+            0.00098, 0.0019, 0.0028, 0.0048, 0.0083, 0.0134, 0.0186, 0.00098
+        };
+
+        return delay[getDLPFMode()];
+    }
+
+/** Drain whole frames from the FIFO.
+ * Frames are decoded into FIFO_FRAME_WORDS words each: accel X/Y/Z,
+ * gyro X/Y/Z, three auxiliary sensor words in slave register order (0 unless
+ * routed into the FIFO, see setupAuxiliaryRead()) and temperature
+ * (0 unless enabled). The FIFO is read in chunks of FIFO_CHUNK_LENGTH bytes
+ * since getFIFO_Data() can not transfer more than 255 bytes at once.
+ * The count may be read while a frame is only partly written, only the
+ * whole frames are read then and the rest is left for the next drain. On
+ * overflow, or if a read fails halfway, the frame boundaries are lost and
+ * the FIFO is reset.
+ * @param frames Storage of maxFrames * FIFO_FRAME_WORDS words
+ * @param maxFrames Maximum frames to read
+ * @param available Whole frames found in the FIFO, the last one is the newest sample
+ * @return frames read, -1 if the FIFO overflowed or failed and was reset
+ * @see setupFIFO()
+ */
+    int MPU6050::readFIFO_Frames(int16_t *frames, int maxFrames, int *available) {
+        if (available) {
+            *available = 0;
+        }
+
+        if (fifo_frame_length == 0) {
+            return 0;
+        }
+
+        uint16_t count = getFIFO_Count();
+
+        if (getFIFO_Overflow() || count >= FIFO_SIZE) {
+            resetFIFO();
+            return -1;
+        }
+
+        int total = count / fifo_frame_length;
+
+        if (available) {
+            *available = total;
+        }
+
+        if (total > maxFrames) {
+            total = maxFrames;
+        }
+
+        const int chunk_frames = FIFO_CHUNK_LENGTH / fifo_frame_length;
+        uint8_t buffer[FIFO_CHUNK_LENGTH];
+        int done = 0;
+
+        while (done < total) {
+            int n = total - done;
+
+            if (n > chunk_frames) {
+                n = chunk_frames;
+            }
+
+            if (!getFIFO_Data(buffer, n * fifo_frame_length)) {
+                resetFIFO();
+                return -1;
+            }
+
+            for (int i = 0; i < n; i++) {
+                decodeFIFO_Frame(&buffer[i * fifo_frame_length],
+                                 &frames[(done + i) * FIFO_FRAME_WORDS]);
+            }
+
+            done += n;
+        }
+
+        return done;
+    }
+
+    void MPU6050::decodeFIFO_Frame(const uint8_t *buffer, int16_t *frame) const {
+        int offset = 0;
+
+        for (int i = 0; i < 3; i++) {
+            frame[i] = decodeWord(&buffer[offset]);
+            offset += 2;
+        }
+
+        if (fifo_temperature) {
+            frame[9] = decodeWord(&buffer[offset]);
+            offset += 2;
+        } else {
+            frame[9] = 0;
+        }
+
+        for (int i = 3; i < 6; i++) {
+            frame[i] = decodeWord(&buffer[offset]);
+            offset += 2;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            if (fifo_auxiliary && i * 2 < aux_length) {
+                frame[6 + i] = decodeWord(&buffer[offset]);
+                offset += 2;
+            } else {
+                frame[6 + i] = 0;
+            }
+        }
+    }
+
+/** Connect the auxiliary I2C bus to the host bus.
+ * Needed to configure devices behind the MPU6050 directly from the host.
+ * @param enabled New bypass status
+ * @see INT_PIN_CFG
+ */
+    void MPU6050::setI2CBypass(bool enabled) {
+        i2c->writeBit(INT_PIN_CFG, enabled ? 1 : 0, I2C_BYPASS_EN_BIT);
+    }
+
+/** Enable the auxiliary I2C master.
+ * @param enabled New I2C master status
+ * @see USER_CTRL
+ */
+    void MPU6050::setI2CMasterMode(bool enabled) {
+        i2c->writeBit(USER_CTRL, enabled ? 1 : 0, I2C_MST_EN_BIT);
+    }
+
+/** Let the MPU6050 poll an auxiliary sensor by itself.
+ * I2C_SLV0 reads length bytes from reg of the slave every (1 + delay)
+ * samples and stores them in EXT_SENS_DATA_00, where they are picked up
+ * together with accel and gyro by getMotionFrame() or by the FIFO. The
+ * bypass is disabled, so the slave is not reachable from the host anymore:
+ * configure it before calling this.
+ * @param slave_address Auxiliary device address
+ * @param reg First register to read
+ * @param length Bytes to read, up to AUX_MAX_LENGTH
+ * @param delay Sample rate divider of the slave reads (0-31)
+ * @see I2C_SLV0_ADDR
+ * @see I2C_MST_CTRL
+ */
+    void MPU6050::setupAuxiliaryRead(uint8_t slave_address, uint8_t reg,
+                                     uint8_t length, uint8_t delay) {
+        if (length > AUX_MAX_LENGTH) {
+            length = AUX_MAX_LENGTH;
+        }
+
+        if (delay > 31) {
+            delay = 31;
+        }
+
+        setI2CMasterMode(false);
+        setI2CBypass(false);
+
+        i2c->writeByte(I2C_MST_CTRL, I2C_MST_CLK_400);
+        i2c->writeByte(I2C_SLV0_ADDR, (1 << I2C_SLV_RW_BIT) | slave_address);
+        i2c->writeByte(I2C_SLV0_REG, reg);
+        i2c->writeByte(I2C_SLV0_CTRL, (1 << I2C_SLV_EN_BIT) | length);
+
+        i2c->writeMoreBits(I2C_SLV4_CTRL, delay, I2C_MST_DLY_LENGTH, 0);
+        i2c->writeBit(I2C_MST_DELAY_CTRL, delay > 0 ? 1 : 0, I2C_SLV0_DLY_EN_BIT);
+
+        setI2CMasterMode(true);
+
+        this->aux_length = length;
+    }
+
+/** Get the length of the auxiliary sensor data.
+ * @return bytes read by I2C_SLV0, 0 if disabled
+ */
+    uint8_t MPU6050::getAuxiliaryLength() const {
+        return this->aux_length;
+    }
+
+
+/** Write consecutive big-endian words, one register at a time.
+ * @param DATA_REGADD Register of the first high byte
+ * @param words Values to write
+ * @param count Number of words
+ */
+    void MPU6050::writeWords(uint8_t DATA_REGADD, const int16_t *words, uint8_t count) {
+        for (uint8_t i = 0; i < count; i++) {
+            i2c->writeByte(DATA_REGADD + i * 2, (uint16_t) words[i] >> 8);
+            i2c->writeByte(DATA_REGADD + i * 2 + 1, (uint16_t) words[i] & 0xFF);
+        }
+    }
+
+/** Get the accelerometer user offset registers.
+ * The offsets are added to the measurements on-chip, so they show up in
+ * the data registers and in the FIFO. They hold factory trim values after
+ * power-up.
+ * @param offsets X/Y/Z, +/-16g full scale, bit 0 is reserved
+ * @see XA_OFFS_USRH
+ */
+    void MPU6050::getAccelOffsets(int16_t *offsets) {
+        uint8_t buffer[6];
+
+        i2c->readRegisters(XA_OFFS_USRH, buffer, 6);
+
+        for (int i = 0; i < 3; i++) {
+            offsets[i] = decodeWord(&buffer[i * 2]);
+        }
+    }
+
+/** Set the accelerometer user offset registers.
+ * Bit 0 of every register is kept as it is.
+ * @param offsets X/Y/Z, +/-16g full scale
+ * @see getAccelOffsets()
+ */
+    void MPU6050::setAccelOffsets(const int16_t *offsets) {
+        int16_t current[3];
+        int16_t words[3];
+
+        getAccelOffsets(current);
+
+        for (int i = 0; i < 3; i++) {
+            words[i] = (offsets[i] & ~1) | (current[i] & 1);
+        }
+
+        writeWords(XA_OFFS_USRH, words, 3);
+    }
+
+/** Get the gyroscope user offset registers.
+ * @param offsets X/Y/Z, +/-1000 deg/s full scale
+ * @see XG_OFFS_USRH
+ */
+    void MPU6050::getGyroOffsets(int16_t *offsets) {
+        uint8_t buffer[6];
+
+        i2c->readRegisters(XG_OFFS_USRH, buffer, 6);
+
+        for (int i = 0; i < 3; i++) {
+            offsets[i] = decodeWord(&buffer[i * 2]);
+        }
+    }
+
+/** Set the gyroscope user offset registers.
+ * @param offsets X/Y/Z, +/-1000 deg/s full scale
+ * @see getGyroOffsets()
+ */
+    void MPU6050::setGyroOffsets(const int16_t *offsets) {
+        writeWords(XG_OFFS_USRH, offsets, 3);
+    }
+
+    static inline int16_t shiftRegister(int16_t reg, double raw, double factor,
+                                        int step, double *done) {
+        long delta = lround(raw * factor / step) * step;
+        long value = (long) reg - delta;
+
+        if (value > 32767) {
+            value = 32767;
+        } else if (value < -32768) {
+            value = -32768;
+        }
+
+        *done = (reg - value) / factor;
+        return (int16_t) value;
+    }
+
+/** Move measured offsets into the user offset registers.
+ * The offsets are given in raw units of the current full-scale ranges and
+ * are converted to the register scales. Only whole register steps can be
+ * taken, the rest stays with the caller.
+ * @param accel Accel X/Y/Z offset to remove, raw LSB
+ * @param gyro Gyro X/Y/Z offset to remove, raw LSB
+ * @param accel_done Part of accel actually removed, raw LSB
+ * @param gyro_done Part of gyro actually removed, raw LSB
+ * @see setAccelOffsets()
+ * @see setGyroOffsets()
+ */
+    void MPU6050::shiftOffsets(const double *accel, const double *gyro,
+                               double *accel_done, double *gyro_done) {
+        double accel_factor = (2 << getRangeAcceleration()) / (double) ACCEL_OFFS_FS;
+        double gyro_factor = (250 << getRangeGyroscope()) / (double) GYRO_OFFS_FS;
+        int16_t accel_regs[3];
+        int16_t gyro_regs[3];
+
+        getAccelOffsets(accel_regs);
+        getGyroOffsets(gyro_regs);
+
+        for (int i = 0; i < 3; i++) {
+            accel_regs[i] = shiftRegister(accel_regs[i], accel[i], accel_factor, 2, &accel_done[i]);
+            gyro_regs[i] = shiftRegister(gyro_regs[i], gyro[i], gyro_factor, 1, &gyro_done[i]);
+        }
+
+        setAccelOffsets(accel_regs);
+        setGyroOffsets(gyro_regs);
+    }
+
 }  // namespace cacaosd_mpu6050
@@ -20,10 +20,16 @@
 
 #include "I2cPort.h"
 
+#define XA_OFFS_USRH 0x06
+#define YA_OFFS_USRH 0x08
+#define ZA_OFFS_USRH 0x0A
 #define SELF_TEST_X 0x0D
 #define SELF_TEST_Y 0x0E
 #define SELF_TEST_Z 0x0F
 #define SELF_TEST_A 0x10
+#define XG_OFFS_USRH 0x13
+#define YG_OFFS_USRH 0x15
+#define ZG_OFFS_USRH 0x17
 #define SMPLRT_DIV 0x19
 #define CONFIG 0x1A
 #define GYRO_CONFIG 0x1B
@@ -66,6 +72,7 @@
 #define GYRO_YOUT_L 0x46
 #define GYRO_ZOUT_H 0x47
 #define GYRO_ZOUT_L 0x48
+#define EXT_SENS_DATA_00 0x49
 #define I2C_SLV0_DO 0x63
 #define I2C_SLV1_DO 0x64
 #define I2C_SLV2_DO 0x65
@@ -94,6 +101,22 @@
 #define DEV_RESET_BIT 7
 #define FIFO_EN_BIT 6
 #define FIFO_RESET_BIT 2
+#define MOTION_BURST_LENGTH 14
+#define FIFO_OFLOW_INT_BIT 4
+#define FIFO_SIZE 1024
+#define FIFO_CHUNK_LENGTH 240
+#define FIFO_FRAME_WORDS 10
+#define I2C_BYPASS_EN_BIT 1
+#define I2C_MST_EN_BIT 5
+#define I2C_MST_RESET_BIT 1
+#define I2C_SLV_EN_BIT 7
+#define I2C_SLV_RW_BIT 7
+#define I2C_SLV0_DLY_EN_BIT 0
+#define I2C_MST_DLY_LENGTH 5
+#define I2C_MST_CLK_400 0x0D
+#define AUX_MAX_LENGTH 6
+#define ACCEL_OFFS_FS 16
+#define GYRO_OFFS_FS 1000
 using namespace cacaosd_i2cport;
 
 namespace cacaosd_mpu6050 {
@@ -126,7 +149,7 @@ namespace cacaosd_mpu6050 {
 
         uint8_t getRangeGyroscope();
 
-        void getAccelerations(int16_t *accels);
+        bool getAccelerations(int16_t *accels);
 
         int16_t getAccelerationX();
 
@@ -134,7 +157,7 @@ namespace cacaosd_mpu6050 {
 
         int16_t getAccelerationZ();
 
-        void getAngularVelocities(int16_t *gyros);
+        bool getAngularVelocities(int16_t *gyros);
 
         int16_t getAngularVelocityX();
 
@@ -142,7 +165,11 @@ namespace cacaosd_mpu6050 {
 
         int16_t getAngularVelocityZ();
 
-        void getMotions6(int16_t *motion6);
+        bool getMotions6(int16_t *motion6);
+
+        bool getMotions7(int16_t *motion7);
+
+        bool getMotionsBurst(uint8_t *buffer);
 
         int16_t getTemperature();
 
@@ -196,15 +223,61 @@ namespace cacaosd_mpu6050 {
 
         uint8_t getFIFO_Enable();
 
-        void getFIFO_Data(uint8_t *data, uint8_t length);
+        bool getFIFO_Data(uint8_t *data, uint8_t length);
 
         void setFIFO_Reset(uint8_t value);
 
         uint8_t getFIFO_Reset();
 
+        uint8_t getFIFO_Overflow();
+
+        void setupFIFO(bool temperature, bool auxiliary);
+
+        void resetFIFO();
+
+        uint8_t getFIFO_FrameLength() const;
+
+        double getSamplePeriod();
+
+        double getGroupDelay();
+
+        int readFIFO_Frames(int16_t *frames, int maxFrames, int *available = NULL);
+
+        bool getMotionFrame(int16_t *frame);
+
+        static void decodeMotions(const uint8_t *buffer, int16_t *motion7);
+
+        void setI2CBypass(bool enabled);
+
+        void setI2CMasterMode(bool enabled);
+
+        void setupAuxiliaryRead(uint8_t slave_address, uint8_t reg,
+                                uint8_t length, uint8_t delay);
+
+        uint8_t getAuxiliaryLength() const;
+
+        void getAccelOffsets(int16_t *offsets);
+
+        void setAccelOffsets(const int16_t *offsets);
+
+        void getGyroOffsets(int16_t *offsets);
+
+        void setGyroOffsets(const int16_t *offsets);
+
+        void shiftOffsets(const double *accel, const double *gyro,
+                          double *accel_done, double *gyro_done);
+
     private:
         I2cPort *i2c;
         uint8_t device_address;
+        uint8_t fifo_frame_length;
+        bool fifo_temperature;
+        bool fifo_auxiliary;
+        uint8_t aux_length;
+
+        void decodeFIFO_Frame(const uint8_t *buffer, int16_t *frame) const;
+
+        void writeWords(uint8_t DATA_REGADD, const int16_t *words, uint8_t count);
     };
 }  // namespace cacaosd_mpu6050
 #endif	/* MPU6050_H */
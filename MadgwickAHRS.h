@@ -8,36 +8,55 @@
 // Date			Author          Notes
 // 29/09/2011	SOH Madgwick    Initial release
 // 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
+// 17/10/2026			Template over the scalar type, batch update
 //
 //=====================================================================================================
 
 #ifndef MadgwickAHRS_h
 #define MadgwickAHRS_h
 
-class MadgwickAHRS {
-private:
+#include "FusionEngine.h"
 
-    double beta;		// algorithm gain
-    double q0, q1, q2, q3;	// quaternion of sensor frame relative to auxiliary frame
-    double aSigma;
+// Filter core, T is the scalar type used for the whole update
 
-    double invSqrt(double x);
+template<typename T>
+class Madgwick : public Strapdown<T> {
+protected:
+    using Strapdown<T>::q0;
+    using Strapdown<T>::q1;
+    using Strapdown<T>::q2;
+    using Strapdown<T>::q3;
+
+    T beta;			// algorithm gain
+    T betaSteady;		// gain once the start boost has annealed
+
+    static T invSqrt(T x);
+
+    void stepAHRS(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz);
+    void stepIMU(T dt, T gx, T gy, T gz, T ax, T ay, T az);
 
 public:
-    double a0, a1, a2;		// acceleration
-    double v0, v1, v2;		// velocity;
-    double x, y, z;		// pos;
+    Madgwick(T beta);
 
+    void update(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz);
+    void updateIMU(T dt, T gx, T gy, T gz, T ax, T ay, T az);
+    void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag);
+};
+
+class MadgwickAHRS : public Madgwick<AHRS_SCALAR>, public FusionEngine {
 public:
     MadgwickAHRS(double beta);
 
-    void update(double dt, double gx, double gy, double gz, double ax, double ay, double az, double mx, double my, double mz);
-    void updateIMU(double dt, double gx, double gy, double gz, double ax, double ay, double az);
-    void getAngles(double *roll, double *pitch, double *yaw);
-    void gravityCompensate(double ax, double ay, double az);
-    void integrate(double dt);
+    const char *getName() const { return "madgwick"; }
 
+    void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag);
     void setAccelSigma(double x);
+    void setAlignment(double time, double gain, double tau);
+    void restore(const AHRSState &s);
+    void setIntegration(bool on);
+    bool getGyroBias(double b[3]) const;
+
+    void publish(double timestamp);
 };
 
 #endif
@@ -0,0 +1,284 @@
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "MadgwickBank.h"
+
+#define DEG_TO_RAD 0.0174533f
+
+/*
+ * BANK_WIDTH floats with the arithmetic the filter needs. Masks are F4 with
+ * all bits set in the lanes where the condition holds.
+ */
+
+#if defined(__SSE2__)
+
+struct F4 { __m128 v; };
+
+static inline F4 splat(float x) { return { _mm_set1_ps(x) }; }
+static inline F4 load(const float *p) { return { _mm_load_ps(p) }; }
+static inline void store(float *p, F4 a) { _mm_store_ps(p, a.v); }
+
+static inline F4 operator+(F4 a, F4 b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline F4 operator-(F4 a, F4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline F4 operator*(F4 a, F4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+static inline F4 operator-(F4 a) { return { _mm_sub_ps(_mm_setzero_ps(), a.v) }; }
+
+static inline F4 sqrt4(F4 a) { return { _mm_sqrt_ps(a.v) }; }
+static inline F4 invSqrt4(F4 a) { return { _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(a.v)) }; }
+
+static inline F4 isZero(F4 a) { return { _mm_cmpeq_ps(a.v, _mm_setzero_ps()) }; }
+static inline F4 operator&(F4 a, F4 b) { return { _mm_and_ps(a.v, b.v) }; }
+static inline F4 operator|(F4 a, F4 b) { return { _mm_or_ps(a.v, b.v) }; }
+static inline F4 select(F4 m, F4 a, F4 b) { return { _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)) }; }
+
+#elif defined(__ARM_NEON)
+
+struct F4 { float32x4_t v; };
+
+static inline F4 splat(float x) { return { vdupq_n_f32(x) }; }
+static inline F4 load(const float *p) { return { vld1q_f32(p) }; }
+static inline void store(float *p, F4 a) { vst1q_f32(p, a.v); }
+
+static inline F4 operator+(F4 a, F4 b) { return { vaddq_f32(a.v, b.v) }; }
+static inline F4 operator-(F4 a, F4 b) { return { vsubq_f32(a.v, b.v) }; }
+static inline F4 operator*(F4 a, F4 b) { return { vmulq_f32(a.v, b.v) }; }
+static inline F4 operator-(F4 a) { return { vnegq_f32(a.v) }; }
+
+// Estimate plus two Newton steps, ARMv7 has no vector sqrt or divide
+
+static inline F4 invSqrt4(F4 a) {
+    float32x4_t e = vrsqrteq_f32(a.v);
+
+    e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(a.v, e), e));
+    e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(a.v, e), e));
+
+    return { e };
+}
+
+static inline F4 isZero(F4 a) { return { vreinterpretq_f32_u32(vceqq_f32(a.v, vdupq_n_f32(0.0f))) }; }
+
+static inline F4 operator&(F4 a, F4 b) {
+    return { vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v))) };
+}
+
+static inline F4 operator|(F4 a, F4 b) {
+    return { vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v))) };
+}
+
+static inline F4 select(F4 m, F4 a, F4 b) { return { vbslq_f32(vreinterpretq_u32_f32(m.v), a.v, b.v) }; }
+
+static inline F4 sqrt4(F4 a) { return select(isZero(a), a, a * invSqrt4(a)); }
+
+#else
+
+struct F4 { float v[BANK_WIDTH]; };
+
+#define F4_MAP(expr) { F4 r; for (int i = 0; i < BANK_WIDTH; i++) r.v[i] = (expr); return r; }
+
+static inline F4 splat(float x) F4_MAP(x)
+static inline F4 load(const float *p) F4_MAP(p[i])
+static inline void store(float *p, F4 a) { memcpy(p, a.v, sizeof(a.v)); }
+
+static inline F4 operator+(F4 a, F4 b) F4_MAP(a.v[i] + b.v[i])
+static inline F4 operator-(F4 a, F4 b) F4_MAP(a.v[i] - b.v[i])
+static inline F4 operator*(F4 a, F4 b) F4_MAP(a.v[i] * b.v[i])
+static inline F4 operator-(F4 a) F4_MAP(-a.v[i])
+
+static inline F4 sqrt4(F4 a) F4_MAP(sqrtf(a.v[i]))
+static inline F4 invSqrt4(F4 a) F4_MAP(1.0f / sqrtf(a.v[i]))
+
+// Masks are 1.0 or 0.0 here
+
+static inline F4 isZero(F4 a) F4_MAP(a.v[i] == 0.0f ? 1.0f : 0.0f)
+static inline F4 operator&(F4 a, F4 b) F4_MAP(a.v[i] * b.v[i])
+static inline F4 operator|(F4 a, F4 b) F4_MAP(a.v[i] + b.v[i] != 0.0f ? 1.0f : 0.0f)
+static inline F4 select(F4 m, F4 a, F4 b) F4_MAP(m.v[i] != 0.0f ? a.v[i] : b.v[i])
+
+#undef F4_MAP
+
+#endif
+
+MadgwickBank::MadgwickBank(int lanes, float beta) : beta(beta), lanes(lanes) {
+    blocks.resize((lanes + BANK_WIDTH - 1) / BANK_WIDTH);
+
+    for (auto &b : blocks)
+	for (int i = 0; i < BANK_WIDTH; i++) {
+	    b.q0[i] = 1.0f;
+	    b.q1[i] = 0.0f;
+	    b.q2[i] = 0.0f;
+	    b.q3[i] = 0.0f;
+	}
+}
+
+/*
+ * data holds 9 values per lane, stride floats apart, as from
+ * Compensation::doIt(): accel in g, gyro in deg/s, mag
+ */
+
+void MadgwickBank::update(float dt, const float *data, size_t stride) {
+    for (size_t n = 0; n < blocks.size(); n++) {
+	int count = lanes - n * BANK_WIDTH;
+
+	step(blocks[n], dt, data + n * BANK_WIDTH * stride, stride, count < BANK_WIDTH ? count : BANK_WIDTH, true);
+    }
+}
+
+void MadgwickBank::updateIMU(float dt, const float *data, size_t stride) {
+    for (size_t n = 0; n < blocks.size(); n++) {
+	int count = lanes - n * BANK_WIDTH;
+
+	step(blocks[n], dt, data + n * BANK_WIDTH * stride, stride, count < BANK_WIDTH ? count : BANK_WIDTH, false);
+    }
+}
+
+/*
+ * Same arithmetic as Madgwick<T>::stepAHRS() and stepIMU(), both gradients
+ * are computed for all lanes and the mask picks one per lane
+ */
+
+void MadgwickBank::step(MadgwickBlock &b, float dt, const float *data, size_t stride, int count, bool mag) {
+    alignas(16) float	in[9][BANK_WIDTH];
+
+    memset(in, 0, sizeof(in));
+
+    for (int l = 0; l < count; l++)
+	for (int i = 0; i < 9; i++)
+	    in[i][l] = data[l * stride + i];
+
+    if (!mag) {
+	memset(in[6], 0, sizeof(in[6]) * 3);
+    }
+
+    F4 q0 = load(b.q0), q1 = load(b.q1), q2 = load(b.q2), q3 = load(b.q3);
+    F4 ax = load(in[0]), ay = load(in[1]), az = load(in[2]);
+    F4 gx = load(in[3]) * splat(DEG_TO_RAD);
+    F4 gy = load(in[4]) * splat(DEG_TO_RAD);
+    F4 gz = load(in[5]) * splat(DEG_TO_RAD);
+    F4 mx = load(in[6]), my = load(in[7]), mz = load(in[8]);
+
+    const F4 half = splat(0.5f), one = splat(1.0f), two = splat(2.0f), four = splat(4.0f);
+
+    // Rate of change of quaternion from gyroscope
+
+    F4 qDot1 = half * (-q1 * gx - q2 * gy - q3 * gz);
+    F4 qDot2 = half * (q0 * gx + q2 * gz - q3 * gy);
+    F4 qDot3 = half * (q0 * gy - q1 * gz + q3 * gx);
+    F4 qDot4 = half * (q0 * gz + q1 * gy - q2 * gx);
+
+    F4 noAccel = isZero(ax) & isZero(ay) & isZero(az);
+    F4 noMag = isZero(mx) & isZero(my) & isZero(mz);
+
+    // Normalise, lanes without a measurement divide by one instead of zero
+
+    F4 recipNorm = invSqrt4(select(noAccel, one, ax * ax + ay * ay + az * az));
+    ax = ax * recipNorm;
+    ay = ay * recipNorm;
+    az = az * recipNorm;
+
+    recipNorm = invSqrt4(select(noMag, one, mx * mx + my * my + mz * mz));
+    mx = mx * recipNorm;
+    my = my * recipNorm;
+    mz = mz * recipNorm;
+
+    // Auxiliary variables to avoid repeated arithmetic
+
+    F4 _2q0 = two * q0, _2q1 = two * q1, _2q2 = two * q2, _2q3 = two * q3;
+    F4 q0q0 = q0 * q0, q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+    F4 q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+    F4 q2q2 = q2 * q2, q2q3 = q2 * q3, q3q3 = q3 * q3;
+
+    // IMU gradient
+
+    F4 _4q0 = four * q0, _4q1 = four * q1, _4q2 = four * q2;
+    F4 _8q1 = two * _4q1, _8q2 = two * _4q2;
+
+    F4 i0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+    F4 i1 = _4q1 * q3q3 - _2q3 * ax + four * q0q0 * q1 - _2q0 * ay - _4q1 + _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+    F4 i2 = four * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 + _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+    F4 i3 = four * q1q1 * q3 - _2q1 * ax + four * q2q2 * q3 - _2q2 * ay;
+
+    // AHRS gradient, reference direction of Earth's magnetic field first
+
+    F4 _2q0mx = _2q0 * mx, _2q0my = _2q0 * my, _2q0mz = _2q0 * mz, _2q1mx = _2q1 * mx;
+
+    F4 hx = mx * q0q0 - _2q0my * q3 + _2q0mz * q2 + mx * q1q1 + _2q1 * my * q2 + _2q1 * mz * q3 - mx * q2q2 - mx * q3q3;
+    F4 hy = _2q0mx * q3 + my * q0q0 - _2q0mz * q1 + _2q1mx * q2 - my * q1q1 + my * q2q2 + _2q2 * mz * q3 - my * q3q3;
+    F4 _2bx = sqrt4(hx * hx + hy * hy);
+    F4 _2bz = -_2q0mx * q2 + _2q0my * q1 + mz * q0q0 + _2q1mx * q3 - mz * q1q1 + _2q2 * my * q3 - mz * q2q2 + mz * q3q3;
+    F4 _4bx = two * _2bx, _4bz = two * _2bz;
+    F4 _8bx = two * _4bx, _8bz = two * _4bz;
+
+    F4 ex = two * (q1q3 - q0q2) - ax;
+    F4 ey = two * (q0q1 + q2q3) - ay;
+    F4 ez = two * (half - q1q1 - q2q2) - az;
+    F4 fx = _4bx * (half - q2q2 - q3q3) + _4bz * (q1q3 - q0q2) - mx;
+    F4 fy = _4bx * (q1q2 - q0q3) + _4bz * (q0q1 + q2q3) - my;
+    F4 fz = _4bx * (q0q2 + q1q3) + _4bz * (half - q1q1 - q2q2) - mz;
+
+    F4 m0 = -_2q2 * ex + _2q1 * ey - _4bz * q2 * fx + (-_4bx * q3 + _4bz * q1) * fy + _4bx * q2 * fz;
+    F4 m1 = _2q3 * ex + _2q0 * ey - four * q1 * ez + _4bz * q3 * fx + (_4bx * q2 + _4bz * q0) * fy + (_4bx * q3 - _8bz * q1) * fz;
+    F4 m2 = -_2q0 * ex + _2q3 * ey - four * q2 * ez + (-_8bx * q2 - _4bz * q0) * fx + (_4bx * q1 + _4bz * q3) * fy + (_4bx * q0 - _8bz * q2) * fz;
+    F4 m3 = _2q1 * ex + _2q2 * ey + (-_8bx * q3 + _4bz * q1) * fx + (-_4bx * q0 + _4bz * q2) * fy + _4bx * q1 * fz;
+
+    F4 s0 = select(noMag, i0, m0);
+    F4 s1 = select(noMag, i1, m1);
+    F4 s2 = select(noMag, i2, m2);
+    F4 s3 = select(noMag, i3, m3);
+
+    // Normalise step magnitude, no feedback without accel
+
+    F4 n = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+    F4 skip = noAccel | isZero(n);
+
+    recipNorm = select(skip, splat(0.0f), invSqrt4(select(skip, one, n))) * splat(beta);
+
+    // Apply feedback step and integrate rate of change of quaternion
+
+    F4 vdt = splat(dt);
+
+    q0 = q0 + (qDot1 - recipNorm * s0) * vdt;
+    q1 = q1 + (qDot2 - recipNorm * s1) * vdt;
+    q2 = q2 + (qDot3 - recipNorm * s2) * vdt;
+    q3 = q3 + (qDot4 - recipNorm * s3) * vdt;
+
+    // Normalise quaternion
+
+    recipNorm = invSqrt4(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+
+    store(b.q0, q0 * recipNorm);
+    store(b.q1, q1 * recipNorm);
+    store(b.q2, q2 * recipNorm);
+    store(b.q3, q3 * recipNorm);
+}
+
+void MadgwickBank::getQuaternion(int lane, float q[4]) const {
+    const MadgwickBlock &b = blocks[lane / BANK_WIDTH];
+    int i = lane % BANK_WIDTH;
+
+    q[0] = b.q0[i];
+    q[1] = b.q1[i];
+    q[2] = b.q2[i];
+    q[3] = b.q3[i];
+}
+
+void MadgwickBank::getAngles(int lane, float *roll, float *pitch, float *yaw) const {
+    float q[4];
+
+    getQuaternion(lane, q);
+
+    float a12 = 2.0f * (q[1] * q[2] + q[0] * q[3]);
+    float a22 = q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3];
+    float a31 = 2.0f * (q[0] * q[1] + q[2] * q[3]);
+    float a32 = 2.0f * (q[1] * q[3] - q[0] * q[2]);
+    float a33 = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3];
+
+    *roll = atan2f(a31, a33);
+    *pitch = -asinf(a32);
+    *yaw = atan2f(a12, a22);
+}
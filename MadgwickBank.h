@@ -0,0 +1,45 @@
+#ifndef MADGWICK_BANK_H
+#define MADGWICK_BANK_H
+
+#include <stddef.h>
+#include <vector>
+
+#define BANK_WIDTH 4
+
+/*
+ * Independent Madgwick filters updated in lockstep, one per IMU. The
+ * quaternions are kept as structure of arrays, BANK_WIDTH lanes per block,
+ * so one SIMD pass runs the update of a whole block. Lanes with zero accel
+ * skip the feedback step and lanes with zero mag fall back to the IMU
+ * gradient, each one on its own.
+ */
+
+class MadgwickBlock {
+public:
+    alignas(16) float	q0[BANK_WIDTH];
+    alignas(16) float	q1[BANK_WIDTH];
+    alignas(16) float	q2[BANK_WIDTH];
+    alignas(16) float	q3[BANK_WIDTH];
+};
+
+class MadgwickBank {
+private:
+    float			beta;
+    int				lanes;
+    std::vector<MadgwickBlock>	blocks;
+
+    void step(MadgwickBlock &b, float dt, const float *data, size_t stride, int count, bool mag);
+
+public:
+    MadgwickBank(int lanes, float beta);
+
+    int getLanes() const { return lanes; }
+
+    void update(float dt, const float *data, size_t stride);
+    void updateIMU(float dt, const float *data, size_t stride);
+
+    void getQuaternion(int lane, float q[4]) const;
+    void getAngles(int lane, float *roll, float *pitch, float *yaw) const;
+};
+
+#endif
@@ -0,0 +1,299 @@
+//=====================================================================================================
+// MahonyAHRS.c
+//=====================================================================================================
+//
+// Madgwick's implementation of Mahony's AHRS algorithm.
+// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
+//
+// Date			Author			Notes
+// 29/09/2011	SOH Madgwick    Initial release
+// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
+// 17/10/2026			Template over the scalar type, batch update
+//
+//=====================================================================================================
+
+//---------------------------------------------------------------------------------------------------
+// Header files
+
+#include "MahonyAHRS.h"
+#include <cmath>
+
+//---------------------------------------------------------------------------------------------------
+// Definitions
+
+#define DEG_TO_RAD 0.0174533
+
+template<typename T>
+Mahony<T>::Mahony(T kp, T ki) : twoKp(T(2) * kp), twoKpSteady(T(2) * kp), twoKi(T(2) * ki) {
+    integralFBx = 0.0;
+    integralFBy = 0.0;
+    integralFBz = 0.0;
+}
+
+template<typename T>
+void Mahony<T>::update(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz) {
+    stepAHRS(dt, gx * T(DEG_TO_RAD), gy * T(DEG_TO_RAD), gz * T(DEG_TO_RAD), ax, ay, az, mx, my, mz);
+}
+
+template<typename T>
+void Mahony<T>::updateIMU(T dt, T gx, T gy, T gz, T ax, T ay, T az) {
+    stepIMU(dt, gx * T(DEG_TO_RAD), gy * T(DEG_TO_RAD), gz * T(DEG_TO_RAD), ax, ay, az);
+}
+
+//---------------------------------------------------------------------------------------------------
+// Batch of corrected samples, see Strapdown<T>::batch()
+
+template<typename T>
+void Mahony<T>::updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag) {
+    const T toRad = T(DEG_TO_RAD);
+
+    this->batch(samples, data, n, period, mag, [&](T dt, const float *d) {
+	twoKp = twoKpSteady * this->boost;
+
+	if (mag && !(d[6] == 0.0f && d[7] == 0.0f && d[8] == 0.0f)) {
+	    stepAHRS(dt, d[3] * toRad, d[4] * toRad, d[5] * toRad, d[0], d[1], d[2], d[6], d[7], d[8]);
+	} else {
+	    stepIMU(dt, d[3] * toRad, d[4] * toRad, d[5] * toRad, d[0], d[1], d[2]);
+	}
+    });
+}
+
+//---------------------------------------------------------------------------------------------------
+// Gyroscope in radians/sec
+
+template<typename T>
+void Mahony<T>::stepAHRS(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz) {
+    T recipNorm;
+    T q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+    T hx, hy, bx, bz;
+    T halfvx, halfvy, halfvz, halfwx, halfwy, halfwz;
+    T halfex, halfey, halfez;
+
+    // Use IMU algorithm if magnetometer measurement invalid (avoids NaN in magnetometer normalisation)
+
+    if ((mx == T(0)) && (my == T(0)) && (mz == T(0))) {
+	stepIMU(dt, gx, gy, gz, ax, ay, az);
+	return;
+    }
+
+    // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+
+    if (!((ax == T(0)) && (ay == T(0)) && (az == T(0)))) {
+	// Normalise accelerometer measurement
+
+	recipNorm = invSqrt(ax * ax + ay * ay + az * az);
+	ax *= recipNorm;
+	ay *= recipNorm;
+	az *= recipNorm;
+
+	// Normalise magnetometer measurement
+
+	recipNorm = invSqrt(mx * mx + my * my + mz * mz);
+	mx *= recipNorm;
+	my *= recipNorm;
+	mz *= recipNorm;
+
+	// Auxiliary variables to avoid repeated arithmetic
+
+	q0q0 = q0 * q0;
+	q0q1 = q0 * q1;
+	q0q2 = q0 * q2;
+	q0q3 = q0 * q3;
+	q1q1 = q1 * q1;
+	q1q2 = q1 * q2;
+	q1q3 = q1 * q3;
+	q2q2 = q2 * q2;
+	q2q3 = q2 * q3;
+	q3q3 = q3 * q3;
+
+	// Reference direction of Earth's magnetic field
+
+	hx = T(2) * (mx * (T(0.5) - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+	hy = T(2) * (mx * (q1q2 + q0q3) + my * (T(0.5) - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+	bx = std::sqrt(hx * hx + hy * hy);
+	bz = T(2) * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (T(0.5) - q1q1 - q2q2));
+
+	// Estimated direction of gravity and magnetic field
+
+	halfvx = q1q3 - q0q2;
+	halfvy = q0q1 + q2q3;
+	halfvz = q0q0 - T(0.5) + q3q3;
+	halfwx = bx * (T(0.5) - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+	halfwy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+	halfwz = bx * (q0q2 + q1q3) + bz * (T(0.5) - q1q1 - q2q2);
+
+	// Error is sum of cross product between estimated direction and measured direction of field vectors
+
+	halfex = (ay * halfvz - az * halfvy) + (my * halfwz - mz * halfwy);
+	halfey = (az * halfvx - ax * halfvz) + (mz * halfwx - mx * halfwz);
+	halfez = (ax * halfvy - ay * halfvx) + (mx * halfwy - my * halfwx);
+
+	// Compute and apply integral feedback if enabled
+
+	if (twoKi > T(0)) {
+	    integralFBx += twoKi * halfex * dt;
+	    integralFBy += twoKi * halfey * dt;
+	    integralFBz += twoKi * halfez * dt;
+	    gx += integralFBx;
+	    gy += integralFBy;
+	    gz += integralFBz;
+	} else {
+	    integralFBx = T(0);
+	    integralFBy = T(0);
+	    integralFBz = T(0);
+	}
+
+	// Apply proportional feedback
+
+	gx += twoKp * halfex;
+	gy += twoKp * halfey;
+	gz += twoKp * halfez;
+    }
+
+    integrateRate(dt, gx, gy, gz);
+}
+
+template<typename T>
+void Mahony<T>::stepIMU(T dt, T gx, T gy, T gz, T ax, T ay, T az) {
+    T recipNorm;
+    T halfvx, halfvy, halfvz;
+    T halfex, halfey, halfez;
+
+    // Compute feedback only if accelerometer measurement valid (avoids NaN in accelerometer normalisation)
+
+    if (!((ax == T(0)) && (ay == T(0)) && (az == T(0)))) {
+	// Normalise accelerometer measurement
+
+	recipNorm = invSqrt(ax * ax + ay * ay + az * az);
+	ax *= recipNorm;
+	ay *= recipNorm;
+	az *= recipNorm;
+
+	// Estimated direction of gravity
+
+	halfvx = q1 * q3 - q0 * q2;
+	halfvy = q0 * q1 + q2 * q3;
+	halfvz = q0 * q0 - T(0.5) + q3 * q3;
+
+	// Error is sum of cross product between estimated and measured direction of gravity
+
+	halfex = (ay * halfvz - az * halfvy);
+	halfey = (az * halfvx - ax * halfvz);
+	halfez = (ax * halfvy - ay * halfvx);
+
+	// Compute and apply integral feedback if enabled
+
+	if (twoKi > T(0)) {
+	    integralFBx += twoKi * halfex * dt;
+	    integralFBy += twoKi * halfey * dt;
+	    integralFBz += twoKi * halfez * dt;
+	    gx += integralFBx;
+	    gy += integralFBy;
+	    gz += integralFBz;
+	} else {
+	    integralFBx = T(0);
+	    integralFBy = T(0);
+	    integralFBz = T(0);
+	}
+
+	// Apply proportional feedback
+
+	gx += twoKp * halfex;
+	gy += twoKp * halfey;
+	gz += twoKp * halfez;
+    }
+
+    integrateRate(dt, gx, gy, gz);
+}
+
+// Integrate rate of change of quaternion and normalise
+
+template<typename T>
+void Mahony<T>::integrateRate(T dt, T gx, T gy, T gz) {
+    T recipNorm;
+    T qa, qb, qc;
+
+    gx *= T(0.5) * dt;
+    gy *= T(0.5) * dt;
+    gz *= T(0.5) * dt;
+
+    qa = q0;
+    qb = q1;
+    qc = q2;
+
+    q0 += (-qb * gx - qc * gy - q3 * gz);
+    q1 += (qa * gx + qc * gz - q3 * gy);
+    q2 += (qa * gy - qb * gz + q3 * gx);
+    q3 += (qa * gz + qb * gy - qc * gx);
+
+    recipNorm = invSqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q0 *= recipNorm;
+    q1 *= recipNorm;
+    q2 *= recipNorm;
+    q3 *= recipNorm;
+}
+
+template<typename T>
+T Mahony<T>::invSqrt(T x) {
+    return T(1) / std::sqrt(x);
+}
+
+template class Mahony<float>;
+template class Mahony<double>;
+
+//---------------------------------------------------------------------------------------------------
+// MahonyAHRS
+
+MahonyAHRS::MahonyAHRS(double kp, double ki) : Mahony<AHRS_SCALAR>(kp, ki) {
+}
+
+// Fuses a whole batch and publishes once at the end of it
+
+void MahonyAHRS::updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag) {
+    if (n == 0) {
+	return;
+    }
+
+    Mahony<AHRS_SCALAR>::updateBatch(samples, data, n, period, mag);
+    publish(timestamp);
+}
+
+void MahonyAHRS::setAccelSigma(double x) {
+    Mahony<AHRS_SCALAR>::setAccelSigma(x);
+}
+
+void MahonyAHRS::setAlignment(double time, double gain, double tau) {
+    Mahony<AHRS_SCALAR>::setAlignment(time, gain, tau);
+}
+
+void MahonyAHRS::restore(const AHRSState &s) {
+    fromState(s);
+}
+
+void MahonyAHRS::setIntegration(bool on) {
+    Mahony<AHRS_SCALAR>::setIntegration(on);
+}
+
+// The integral feedback is added to the rate, so it is minus the bias. None without Ki.
+
+bool MahonyAHRS::getGyroBias(double b[3]) const {
+    if (twoKi <= 0.0) {
+	return false;
+    }
+
+    b[0] = -integralFBx;
+    b[1] = -integralFBy;
+    b[2] = -integralFBz;
+    return true;
+}
+
+// Called by the fusion thread after each update. Readers never block it.
+
+void MahonyAHRS::publish(double timestamp) {
+    AHRSState s;
+
+    this->timestamp = timestamp;
+
+    toState(s);
+    store(s);
+}
@@ -0,0 +1,65 @@
+//=====================================================================================================
+// MahonyAHRS.h
+//=====================================================================================================
+//
+// Madgwick's implementation of Mahony's AHRS algorithm.
+// See: http://www.x-io.co.uk/node/8#open_source_ahrs_and_imu_algorithms
+//
+// Date			Author			Notes
+// 29/09/2011	SOH Madgwick    Initial release
+// 02/10/2011	SOH Madgwick	Optimised for reduced CPU load
+// 17/10/2026			Template over the scalar type, batch update
+//
+//=====================================================================================================
+
+#ifndef MahonyAHRS_h
+#define MahonyAHRS_h
+
+#include "FusionEngine.h"
+
+// Complementary filter with a PI correction of the gyro, cheaper per update than the gradient step
+
+template<typename T>
+class Mahony : public Strapdown<T> {
+protected:
+    using Strapdown<T>::q0;
+    using Strapdown<T>::q1;
+    using Strapdown<T>::q2;
+    using Strapdown<T>::q3;
+
+    T twoKp;			// 2 * proportional gain
+    T twoKpSteady;		// twoKp once the start boost has annealed
+    T twoKi;			// 2 * integral gain
+    T integralFBx, integralFBy, integralFBz;	// integral error terms scaled by Ki
+
+    static T invSqrt(T x);
+
+    void stepAHRS(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz);
+    void stepIMU(T dt, T gx, T gy, T gz, T ax, T ay, T az);
+    void integrateRate(T dt, T gx, T gy, T gz);
+
+public:
+    Mahony(T kp, T ki);
+
+    void update(T dt, T gx, T gy, T gz, T ax, T ay, T az, T mx, T my, T mz);
+    void updateIMU(T dt, T gx, T gy, T gz, T ax, T ay, T az);
+    void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag);
+};
+
+class MahonyAHRS : public Mahony<AHRS_SCALAR>, public FusionEngine {
+public:
+    MahonyAHRS(double kp, double ki);
+
+    const char *getName() const { return "mahony"; }
+
+    void updateBatch(const Sample *samples, const float *data, size_t n, double period, bool mag);
+    void setAccelSigma(double x);
+    void setAlignment(double time, double gain, double tau);
+    void restore(const AHRSState &s);
+    void setIntegration(bool on);
+    bool getGyroBias(double b[3]) const;
+
+    void publish(double timestamp);
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+/*
+ * Fixed size matrix for the filters. Storage is inline, nothing is
+ * allocated, the sizes are checked by the compiler.
+ */
+
+template<typename T, int R, int C>
+class Matrix {
+public:
+    T	m[R][C];
+
+    static Matrix zero() {
+	Matrix	res;
+
+	for (int i = 0; i < R; i++)
+	    for (int j = 0; j < C; j++)
+		res.m[i][j] = T(0);
+
+	return res;
+    }
+
+    static Matrix identity(T x = T(1)) {
+	Matrix	res = zero();
+
+	for (int i = 0; i < R && i < C; i++)
+	    res.m[i][i] = x;
+
+	return res;
+    }
+
+    T &operator()(int r, int c) {
+	return m[r][c];
+    }
+
+    const T &operator()(int r, int c) const {
+	return m[r][c];
+    }
+
+    Matrix operator+(const Matrix &b) const {
+	Matrix	res;
+
+	for (int i = 0; i < R; i++)
+	    for (int j = 0; j < C; j++)
+		res.m[i][j] = m[i][j] + b.m[i][j];
+
+	return res;
+    }
+
+    Matrix operator-(const Matrix &b) const {
+	Matrix	res;
+
+	for (int i = 0; i < R; i++)
+	    for (int j = 0; j < C; j++)
+		res.m[i][j] = m[i][j] - b.m[i][j];
+
+	return res;
+    }
+
+    Matrix operator*(T x) const {
+	Matrix	res;
+
+	for (int i = 0; i < R; i++)
+	    for (int j = 0; j < C; j++)
+		res.m[i][j] = m[i][j] * x;
+
+	return res;
+    }
+
+    template<int K>
+    Matrix<T, R, K> operator*(const Matrix<T, C, K> &b) const {
+	Matrix<T, R, K>	res;
+
+	for (int i = 0; i < R; i++)
+	    for (int j = 0; j < K; j++) {
+		T	sum = T(0);
+
+		for (int k = 0; k < C; k++)
+		    sum += m[i][k] * b.m[k][j];
+
+		res.m[i][j] = sum;
+	    }
+
+	return res;
+    }
+
+    Matrix<T, C, R> transpose() const {
+	Matrix<T, C, R>	res;
+
+	for (int i = 0; i < R; i++)
+	    for (int j = 0; j < C; j++)
+		res.m[j][i] = m[i][j];
+
+	return res;
+    }
+};
+
+// Cross product matrix, skew(v) * x == v x x
+
+template<typename T>
+Matrix<T, 3, 3> skew(T x, T y, T z) {
+    Matrix<T, 3, 3>	res;
+
+    res.m[0][0] = T(0);	res.m[0][1] = -z;	res.m[0][2] = y;
+    res.m[1][0] = z;	res.m[1][1] = T(0);	res.m[1][2] = -x;
+    res.m[2][0] = -y;	res.m[2][1] = x;	res.m[2][2] = T(0);
+
+    return res;
+}
+
+// Mean of a and its transpose, keeps covariances symmetric against rounding
+
+template<typename T>
+Matrix<T, 3, 3> symmetric(const Matrix<T, 3, 3> &a) {
+    Matrix<T, 3, 3>	res;
+
+    for (int i = 0; i < 3; i++)
+	for (int j = 0; j < 3; j++)
+	    res.m[i][j] = T(0.5) * (a.m[i][j] + a.m[j][i]);
+
+    return res;
+}
+
+// Inverses, false if a is singular
+
+template<typename T>
+bool invert(const Matrix<T, 1, 1> &a, Matrix<T, 1, 1> &res) {
+    if (a.m[0][0] == T(0)) {
+	return false;
+    }
+
+    res.m[0][0] = T(1) / a.m[0][0];
+    return true;
+}
+
+// 3x3 by cofactors
+
+template<typename T>
+bool invert(const Matrix<T, 3, 3> &a, Matrix<T, 3, 3> &res) {
+    const T (*m)[3] = a.m;
+
+    T c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    T c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    T c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    T det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+
+    if (det == T(0)) {
+	return false;
+    }
+
+    T r = T(1) / det;
+
+    res.m[0][0] = c00 * r;
+    res.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * r;
+    res.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * r;
+    res.m[1][0] = c01 * r;
+    res.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * r;
+    res.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * r;
+    res.m[2][0] = c02 * r;
+    res.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * r;
+    res.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * r;
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,259 @@
+#include <math.h>
+
+#include "Preintegration.h"
+
+#define GRAVITY		9.80665
+#define DEG_TO_RAD	(M_PI / 180.0)
+
+static Matrix3 rotation(double x, double y, double z) {
+    Matrix3 s = skew(x, y, z);
+
+    /* Second order Exp(), one sample turns by a few hundredths of a radian at most */
+
+    return Matrix3::identity() + s + s * s * 0.5;
+}
+
+static void apply(const Matrix3 &m, const double x[3], double res[3]) {
+    for (int i = 0; i < 3; i++)
+	res[i] = m(i, 0) * x[0] + m(i, 1) * x[1] + m(i, 2) * x[2];
+}
+
+/*
+ * Keyframe values for a bias other than the one the samples were taken
+ * with, to first order
+ */
+
+void Keyframe::correct(const double bg[3], const double ba[3], Matrix3 &R, double v[3], double p[3]) const {
+    double	dg[3], da[3], r[3];
+
+    for (int i = 0; i < 3; i++) {
+	dg[i] = bg[i] - this->bg[i];
+	da[i] = ba[i] - this->ba[i];
+    }
+
+    apply(JRg, dg, r);
+    R = dR * rotation(r[0], r[1], r[2]);
+
+    for (int i = 0; i < 3; i++) {
+	v[i] = dv[i];
+	p[i] = dp[i];
+
+	for (int n = 0; n < 3; n++) {
+	    v[i] += Jvg(i, n) * dg[n] + Jva(i, n) * da[n];
+	    p[i] += Jpg(i, n) * dg[n] + Jpa(i, n) * da[n];
+	}
+    }
+}
+
+Preintegration::Preintegration() {
+    const double zero[3] = { 0, 0, 0 };
+    const double q[4] = { 1, 0, 0, 0 };
+
+    setBias(zero, zero);
+    open(q, false);
+}
+
+void Preintegration::setBias(const double bg[3], const double ba[3]) {
+    for (int i = 0; i < 3; i++) {
+	k.bg[i] = bg[i];
+	k.ba[i] = ba[i];
+    }
+}
+
+// Starts the next keyframe at the filter attitude q
+
+void Preintegration::open(const double q[4], bool valid) {
+    for (int i = 0; i < 4; i++)
+	k.q[i] = q[i];
+
+    k.valid = valid;
+
+    for (int i = 0; i < 3; i++) {
+	k.dv[i] = 0;
+	k.dp[i] = 0;
+    }
+
+    k.dR = Matrix3::identity();
+    k.JRg = Matrix3::zero();
+    k.Jvg = Matrix3::zero();
+    k.Jva = Matrix3::zero();
+    k.Jpg = Matrix3::zero();
+    k.Jpa = Matrix3::zero();
+
+    k.start = 0.0;
+    k.end = 0.0;
+    k.dt = 0.0;
+    k.count = 0;
+}
+
+/*
+ * One corrected sample as from Compensation::doIt(), dt is its step. The
+ * velocity and position use the rotation at the start of the step, the
+ * rotation is advanced last.
+ */
+
+void Preintegration::add(double time, double dt, const float *d) {
+    double	a[3], w[3], f[3];
+
+    for (int i = 0; i < 3; i++) {
+	a[i] = d[i] * GRAVITY - k.ba[i];
+	w[i] = d[i + 3] * DEG_TO_RAD - k.bg[i];
+    }
+
+    if (k.count == 0) {
+	k.start = time;
+    }
+
+    k.end = time;
+    k.count++;
+
+    double	dt2 = 0.5 * dt * dt;
+    Matrix3	RaJ = k.dR * skew(a[0], a[1], a[2]) * k.JRg;
+
+    apply(k.dR, a, f);
+
+    for (int i = 0; i < 3; i++) {
+	k.dp[i] += k.dv[i] * dt + f[i] * dt2;
+	k.dv[i] += f[i] * dt;
+    }
+
+    k.Jpa = k.Jpa + k.Jva * dt - k.dR * dt2;
+    k.Jpg = k.Jpg + k.Jvg * dt - RaJ * dt2;
+    k.Jva = k.Jva - k.dR * dt;
+    k.Jvg = k.Jvg - RaJ * dt;
+
+    Matrix3 E = rotation(w[0] * dt, w[1] * dt, w[2] * dt);
+
+    k.dR = k.dR * E;
+    k.JRg = E.transpose() * k.JRg - Matrix3::identity(dt);
+    k.dt += dt;
+}
+
+/*
+ * Hands out the keyframe with dR made orthonormal again. The caller opens
+ * the next one.
+ */
+
+void Preintegration::close(Keyframe &out) {
+    Matrix3	&R = k.dR;
+    double	n, dot;
+
+    n = 1.0 / sqrt(R(0, 0) * R(0, 0) + R(0, 1) * R(0, 1) + R(0, 2) * R(0, 2));
+
+    for (int i = 0; i < 3; i++)
+	R(0, i) *= n;
+
+    dot = R(0, 0) * R(1, 0) + R(0, 1) * R(1, 1) + R(0, 2) * R(1, 2);
+
+    for (int i = 0; i < 3; i++)
+	R(1, i) -= dot * R(0, i);
+
+    n = 1.0 / sqrt(R(1, 0) * R(1, 0) + R(1, 1) * R(1, 1) + R(1, 2) * R(1, 2));
+
+    for (int i = 0; i < 3; i++)
+	R(1, i) *= n;
+
+    R(2, 0) = R(0, 1) * R(1, 2) - R(0, 2) * R(1, 1);
+    R(2, 1) = R(0, 2) * R(1, 0) - R(0, 0) * R(1, 2);
+    R(2, 2) = R(0, 0) * R(1, 1) - R(0, 1) * R(1, 0);
+
+    out = k;
+}
+
+///
+
+Navigation::Navigation(double zupt) : zupt(zupt) {
+    reset();
+}
+
+/*
+ * New bias estimate, applied to the coming keyframes through their
+ * Jacobians. Safe from any thread.
+ */
+
+void Navigation::setBias(const double bg[3], const double ba[3]) {
+    ImuBias	b;
+
+    for (int i = 0; i < 3; i++) {
+	b.bg[i] = bg[i];
+	b.ba[i] = ba[i];
+    }
+
+    bias.store(b);
+}
+
+void Navigation::reset() {
+    for (int i = 0; i < 3; i++) {
+	v[i] = 0;
+	p[i] = 0;
+    }
+}
+
+void Navigation::add(const Keyframe &k) {
+    Matrix3	dR, R;
+    ImuBias	b;
+    double	dv[3], dp[3], f[3], r[3];
+    double	T = k.dt;
+    const double *q = k.q;
+
+    if (!k.valid || k.count == 0 || T <= 0) {
+	return;
+    }
+
+    bias.load(b);
+    k.correct(b.bg, b.ba, dR, dv, dp);
+
+    /* Sensor to earth at the keyframe start */
+
+    R(0, 0) = q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3];
+    R(0, 1) = 2.0 * (q[1] * q[2] - q[0] * q[3]);
+    R(0, 2) = 2.0 * (q[1] * q[3] + q[0] * q[2]);
+    R(1, 0) = 2.0 * (q[1] * q[2] + q[0] * q[3]);
+    R(1, 1) = q[0] * q[0] - q[1] * q[1] + q[2] * q[2] - q[3] * q[3];
+    R(1, 2) = 2.0 * (q[2] * q[3] - q[0] * q[1]);
+    R(2, 0) = 2.0 * (q[1] * q[3] - q[0] * q[2]);
+    R(2, 1) = 2.0 * (q[2] * q[3] + q[0] * q[1]);
+    R(2, 2) = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3];
+
+    apply(R, dv, f);
+    apply(R, dp, r);
+
+    f[2] -= GRAVITY * T;
+
+    double	a = sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]) / T;
+    bool	stationary = a < zupt;
+
+    if (stationary) {
+	v[0] = v[1] = v[2] = 0;
+    } else {
+	for (int i = 0; i < 3; i++) {
+	    p[i] += v[i] * T + r[i];
+	    v[i] += f[i];
+	}
+
+	p[2] -= 0.5 * GRAVITY * T * T;
+    }
+
+    NavState	s;
+
+    for (int i = 0; i < 3; i++) {
+	s.v[i] = v[i];
+	s.p[i] = p[i];
+    }
+
+    s.time = k.end;
+    s.keyframes = ++keyframes;
+    s.stationary = stationary;
+
+    state.store(s);
+}
+
+// Safe from any thread. Returns the number of keyframes, 0 before the first one.
+
+unsigned long Navigation::getState(NavState &s) const {
+    if (state.load(s) == 0) {
+	return 0;
+    }
+
+    return s.keyframes;
+}
@@ -0,0 +1,110 @@
+#ifndef PREINTEGRATION_H
+#define PREINTEGRATION_H
+
+#include "Matrix.h"
+#include "SeqLock.h"
+
+typedef Matrix<double, 3, 3> Matrix3;
+
+/*
+ * Motion between two keyframes in the sensor frame of the first one:
+ * rotation dR, velocity change dv and position change dp from the
+ * specific force, gravity is left to the consumer. The Jacobians give
+ * the first order change of dR, dv, dp with the gyro and accel bias, so
+ * a new bias estimate is applied without the raw samples.
+ */
+
+class Keyframe {
+public:
+    double	start = 0.0;		// time of the first and the last sample, s
+    double	end = 0.0;
+    double	dt = 0.0;		// sum of the sample steps, s
+    int		count = 0;
+
+    double	q[4] = { 1, 0, 0, 0 };	// filter attitude at start
+    bool	valid = false;		// the filter had converged then
+
+    Matrix3	dR;
+    double	dv[3];			// m/s
+    double	dp[3];			// m
+
+    double	bg[3];			// bias the samples were taken with, rad/s
+    double	ba[3];			// m/s^2
+
+    Matrix3	JRg;			// d(dR)/d(bg), right perturbation
+    Matrix3	Jvg, Jva;
+    Matrix3	Jpg, Jpa;
+
+    void correct(const double bg[3], const double ba[3], Matrix3 &R, double v[3], double p[3]) const;
+};
+
+/*
+ * Accumulates samples into the open keyframe. Runs on the fusion thread,
+ * one add() per sample, close() hands out the keyframe and opens the next.
+ */
+
+class Preintegration {
+private:
+    Keyframe	k;
+
+public:
+    Preintegration();
+
+    void setBias(const double bg[3], const double ba[3]);
+    void open(const double q[4], bool valid);
+
+    void add(double time, double dt, const float *d);
+    void close(Keyframe &out);
+
+    double elapsed() const { return k.dt; }
+};
+
+// Bias estimate, gyro in rad/s, accel in m/s^2
+
+class ImuBias {
+public:
+    double	bg[3] = { 0, 0, 0 };
+    double	ba[3] = { 0, 0, 0 };
+};
+
+// Navigation solution, coherent copy for other threads
+
+class NavState {
+public:
+    double	v[3];			// m/s, earth frame
+    double	p[3];			// m
+    double	time;			// end of the last keyframe, s
+    unsigned long keyframes;
+    bool	stationary;
+};
+
+/*
+ * Consumer side, runs at the keyframe rate on its own thread. Velocity and
+ * position in the earth frame, the keyframe attitude anchors each step.
+ * Keyframes whose average acceleration is below the zero velocity gate
+ * count as standing still and zero the velocity. The newest bias estimate
+ * may come from any thread, every keyframe is corrected to it through its
+ * Jacobians.
+ */
+
+class Navigation {
+private:
+    double	v[3];
+    double	p[3];
+    double	zupt;			// m/s^2
+    unsigned long keyframes = 0;
+
+    SeqLock<ImuBias> bias;
+    SeqLock<NavState> state;
+
+public:
+    Navigation(double zupt);
+
+    void setBias(const double bg[3], const double ba[3]);
+    void add(const Keyframe &k);
+    void reset();
+
+    unsigned long getState(NavState &s) const;
+};
+
+#endif
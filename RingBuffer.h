@@ -0,0 +1,97 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <stddef.h>
+
+class RingStats {
+public:
+    unsigned long	capacity = 0;
+    unsigned long	occupancy = 0;
+    unsigned long	maxOccupancy = 0;
+    unsigned long	pushed = 0;
+    unsigned long	drops = 0;		// pushes refused because the ring was full
+};
+
+class RingBase {
+public:
+    virtual ~RingBase() {}
+
+    virtual RingStats getStats() const = 0;
+};
+
+/*
+ * Lock-free single producer, single consumer ring. Exactly one thread may
+ * push and exactly one thread may pop. N must be a power of two.
+ */
+
+template <typename T, size_t N>
+class RingBuffer : public RingBase {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+
+private:
+    T				items[N];
+
+    alignas(64) std::atomic<size_t>	head;	// written by the producer
+    alignas(64) std::atomic<size_t>	tail;	// written by the consumer
+
+    std::atomic<unsigned long>	pushed;
+    std::atomic<unsigned long>	drops;
+    std::atomic<unsigned long>	maxOccupancy;
+
+public:
+    RingBuffer() : head(0), tail(0), pushed(0), drops(0), maxOccupancy(0) {
+    }
+
+    bool push(const T &item) {
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t used = h - tail.load(std::memory_order_acquire);
+
+	if (used >= N) {
+	    drops.fetch_add(1, std::memory_order_relaxed);
+	    return false;
+	}
+
+	items[h & (N - 1)] = item;
+	head.store(h + 1, std::memory_order_release);
+
+	pushed.fetch_add(1, std::memory_order_relaxed);
+
+	if (used + 1 > maxOccupancy.load(std::memory_order_relaxed)) {
+	    maxOccupancy.store(used + 1, std::memory_order_relaxed);
+	}
+
+	return true;
+    }
+
+    bool pop(T &item) {
+	size_t t = tail.load(std::memory_order_relaxed);
+
+	if (t == head.load(std::memory_order_acquire)) {
+	    return false;
+	}
+
+	item = items[t & (N - 1)];
+	tail.store(t + 1, std::memory_order_release);
+
+	return true;
+    }
+
+    size_t size() const {
+	return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    RingStats getStats() const {
+	RingStats stats;
+
+	stats.capacity = N;
+	stats.occupancy = size();
+	stats.maxOccupancy = maxOccupancy.load(std::memory_order_relaxed);
+	stats.pushed = pushed.load(std::memory_order_relaxed);
+	stats.drops = drops.load(std::memory_order_relaxed);
+
+	return stats;
+    }
+};
+
+#endif
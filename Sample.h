@@ -0,0 +1,26 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <inttypes.h>
+
+#define SAMPLE_WORDS 10
+
+/*
+ * Raw sample as read from the sensors. The words follow the MPU6050 frame
+ * layout (see FIFO_FRAME_WORDS): accel X/Y/Z, gyro X/Y/Z, mag X/Y/Z,
+ * temperature.
+ */
+
+class Sample {
+public:
+    double	time = 0.0;		// CLOCK_MONOTONIC, s, corrected for the sensor group delay
+    int16_t	m[SAMPLE_WORDS];
+    bool	magFresh = false;	// mag words were not used by an earlier sample
+
+    Sample() {
+	for (int i = 0; i < SAMPLE_WORDS; i++)
+	    m[i] = 0;
+    }
+};
+
+#endif
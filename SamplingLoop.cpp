@@ -0,0 +1,176 @@
+#include <iostream>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "SamplingLoop.h"
+
+static long timespecDiff(const struct timespec &a, const struct timespec &b) {
+    return (a.tv_sec - b.tv_sec) * 1000000000L + (a.tv_nsec - b.tv_nsec);
+}
+
+static void timespecAdd(struct timespec &ts, long ns) {
+    ts.tv_nsec += ns;
+
+    while (ts.tv_nsec >= 1000000000L) {
+	ts.tv_nsec -= 1000000000L;
+	ts.tv_sec++;
+    }
+}
+
+SamplingLoop::SamplingLoop(std::function<void()> work, long period) : work(work), period(period) {
+    running = false;
+
+    ticks = 0;
+    overruns = 0;
+    missed = 0;
+    drops = 0;
+    lateness = 0;
+    maxLateness = 0;
+    maxWork = 0;
+}
+
+SamplingLoop::~SamplingLoop() {
+    stop();
+}
+
+void SamplingLoop::setPriority(int priority) {
+    this->priority = priority;
+}
+
+void SamplingLoop::setCpu(int cpu) {
+    this->cpu = cpu;
+}
+
+void SamplingLoop::start() {
+    if (thread) {
+	return;
+    }
+
+    running = true;
+    thread = new std::thread(&SamplingLoop::run, this);
+}
+
+void SamplingLoop::stop() {
+    if (!thread) {
+	return;
+    }
+
+    running = false;
+    thread->join();
+
+    delete thread;
+    thread = NULL;
+}
+
+SamplingStats SamplingLoop::getStats() const {
+    SamplingStats stats;
+
+    stats.ticks = ticks;
+    stats.overruns = overruns;
+    stats.missed = missed;
+    stats.drops = drops;
+    stats.lateness = lateness;
+    stats.maxLateness = maxLateness;
+    stats.maxWork = maxWork;
+
+    return stats;
+}
+
+bool SamplingLoop::lockMemory() {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+	std::cout << "Sampling: mlockall failed: " << strerror(errno) << std::endl;
+	return false;
+    }
+
+    return true;
+}
+
+void SamplingLoop::setupThread() {
+    if (cpu >= 0) {
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+	    std::cout << "Sampling: can not pin to CPU " << cpu << std::endl;
+	}
+    }
+
+    if (priority > 0) {
+	struct sched_param param;
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+	    std::cout << "Sampling: can not set SCHED_FIFO priority " << priority << std::endl;
+	}
+    }
+}
+
+/*
+ * Deadlines are absolute on CLOCK_MONOTONIC, so a long callback or a wall
+ * clock step does not shift the following ticks, and callbacks never overlap.
+ * A tick woken up more than a period late, or a callback running longer than
+ * a period, is an overrun. Whole periods already passed are skipped rather
+ * than run back to back: the callback sees them in getMissed() and decides
+ * how to catch up.
+ */
+
+void SamplingLoop::run() {
+    struct timespec next, now, done;
+
+    setupThread();
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (running) {
+	timespecAdd(next, period);
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	long late = timespecDiff(now, next);
+	bool overrun = false;
+
+	tickMissed = 0;
+
+	if (late >= period) {
+	    tickMissed = late / period;
+	    timespecAdd(next, tickMissed * period);
+
+	    missed += tickMissed;
+	    overrun = true;
+	}
+
+	lateness = late;
+
+	if (late > maxLateness) {
+	    maxLateness = late;
+	}
+
+	ticks++;
+	work();
+
+	clock_gettime(CLOCK_MONOTONIC, &done);
+
+	long busy = timespecDiff(done, now);
+
+	if (busy > maxWork) {
+	    maxWork = busy;
+	}
+
+	if (busy > period) {
+	    overrun = true;
+	}
+
+	if (overrun) {
+	    overruns++;
+	}
+    }
+}
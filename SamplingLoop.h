@@ -0,0 +1,63 @@
+#ifndef SAMPLING_LOOP_H
+#define SAMPLING_LOOP_H
+
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <time.h>
+
+class SamplingStats {
+public:
+    unsigned long	ticks = 0;
+    unsigned long	overruns = 0;		// ticks late by more than a period or longer than a period
+    unsigned long	missed = 0;		// ticks skipped to get back on schedule
+    unsigned long	drops = 0;		// samples lost by the callback
+    long		lateness = 0;		// ns, last tick
+    long		maxLateness = 0;	// ns
+    long		maxWork = 0;		// ns, longest callback
+};
+
+class SamplingLoop {
+private:
+    std::function<void()>	work;
+    long			period;		// ns
+    int				priority = 0;
+    int				cpu = -1;
+
+    std::thread*		thread = NULL;
+    std::atomic<bool>		running;
+
+    std::atomic<unsigned long>	ticks;
+    std::atomic<unsigned long>	overruns;
+    std::atomic<unsigned long>	missed;
+    std::atomic<unsigned long>	drops;
+    std::atomic<long>		lateness;
+    std::atomic<long>		maxLateness;
+    std::atomic<long>		maxWork;
+    unsigned			tickMissed = 0;
+
+    void run();
+    void setupThread();
+
+public:
+    SamplingLoop(std::function<void()> work, long period);
+    virtual ~SamplingLoop();
+
+    void setPriority(int priority);
+    void setCpu(int cpu);
+
+    long getPeriod() const { return period; }
+
+    long getLateness() const { return lateness; }
+    unsigned getMissed() const { return tickMissed; }
+    void countDrop(unsigned n = 1) { drops += n; }
+
+    SamplingStats getStats() const;
+
+    void start();
+    void stop();
+
+    static bool lockMemory();
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SEQ_LOCK_H
+#define SEQ_LOCK_H
+
+#include <atomic>
+#include <string.h>
+#include <type_traits>
+
+/*
+ * Single writer, many readers latest-value cell. The writer never blocks,
+ * readers retry while a store is in progress, so they always get a value
+ * from one store, never a mix of two.
+ */
+
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+private:
+    std::atomic<unsigned>	seq;
+    T				value;
+
+public:
+    SeqLock() : seq(0), value() {
+    }
+
+    void store(const T &v) {
+	unsigned s = seq.load(std::memory_order_relaxed);
+
+	seq.store(s + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	memcpy((void *) &value, &v, sizeof(T));
+
+	seq.store(s + 2, std::memory_order_release);
+    }
+
+    /* Returns the sequence number of the value, 0 if nothing was stored yet */
+
+    unsigned load(T &v) const {
+	unsigned s1, s2;
+
+	do {
+	    s1 = seq.load(std::memory_order_acquire);
+
+	    memcpy(&v, (const void *) &value, sizeof(T));
+	    std::atomic_thread_fence(std::memory_order_acquire);
+
+	    s2 = seq.load(std::memory_order_relaxed);
+	} while ((s1 & 1) || s1 != s2);
+
+	return s1 / 2;
+    }
+
+    unsigned sequence() const {
+	return seq.load(std::memory_order_acquire) / 2;
+    }
+};
+
+#endif
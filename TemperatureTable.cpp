@@ -0,0 +1,289 @@
+#include <iostream>
+
+#include <math.h>
+#include <time.h>
+
+#include "TemperatureTable.h"
+
+// Whole numbers may come back as integers, signed or not
+
+double number(const json_value& v) {
+    if (v.is_uint()) {
+	return v.as_uint();
+    }
+
+    return v.is_int() ? v.as_int() : v.as_real();
+}
+
+int TemperatureTable::index(double t) const {
+    int i = (int) floor((t - base) / step);
+
+    if (i < 0)
+	return 0;
+
+    if (i >= TEMPERATURE_BINS)
+	return TEMPERATURE_BINS - 1;
+
+    return i;
+}
+
+void TemperatureTable::clear() {
+    for (int i = 0; i < TEMPERATURE_BINS; i++)
+	bin[i] = TemperatureBin();
+}
+
+bool TemperatureTable::empty() const {
+    for (int i = 0; i < TEMPERATURE_BINS; i++)
+	if (bin[i].n >= minCount)
+	    return false;
+
+    return true;
+}
+
+/*
+ * gyro is the window average in raw LSB, accel the corrected window average
+ * in g. Windows closer than interval to the last one added are ignored.
+ */
+
+void TemperatureTable::add(double t, const double gyro[3], const double accel[3]) {
+    double		now = time(NULL);
+
+    if (now - last < interval && now >= last) {
+	return;
+    }
+
+    last = now;
+
+    TemperatureBin	&b = bin[index(t)];
+    double		r = sqrt(accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2]);
+    double		k = b.n > 0 && now > b.time ? exp(-(now - b.time) / memory) : 1.0;
+
+    for (int i = 0; i < 6; i++)
+	b.aa[i] *= k;
+
+    for (int i = 0; i < 3; i++)
+	b.ay[i] *= k;
+
+    b.n++;
+    b.w = b.w * k + 1.0;
+    b.time = now;
+    b.t += (t - b.t) / b.w;
+
+    for (int i = 0; i < 3; i++)
+	b.g[i] += (gyro[i] - b.g[i]) / b.w;
+
+    if (r == 0)
+	return;
+
+    double n[3] = { accel[0] / r, accel[1] / r, accel[2] / r };
+
+    b.aa[0] += n[0] * n[0];
+    b.aa[1] += n[0] * n[1];
+    b.aa[2] += n[0] * n[2];
+    b.aa[3] += n[1] * n[1];
+    b.aa[4] += n[1] * n[2];
+    b.aa[5] += n[2] * n[2];
+
+    for (int i = 0; i < 3; i++)
+	b.ay[i] += n[i] * (r - 1.0);
+}
+
+/*
+ * Regularized towards zero, so the axes never seen along gravity keep no
+ * correction instead of a guess
+ */
+
+bool TemperatureTable::accelBias(const TemperatureBin &b, double a[3]) const {
+    const double	l = 0.01 * b.w;
+    double		m[3][3] = {
+	{ b.aa[0] + l, b.aa[1], b.aa[2] },
+	{ b.aa[1], b.aa[3] + l, b.aa[4] },
+	{ b.aa[2], b.aa[4], b.aa[5] + l }
+    };
+
+    double det =
+	m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+	m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+	m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+    if (det <= 0)
+	return false;
+
+    for (int i = 0; i < 3; i++) {
+	double c[3][3];
+
+	for (int r = 0; r < 3; r++)
+	    for (int k = 0; k < 3; k++)
+		c[r][k] = (k == i) ? b.ay[r] : m[r][k];
+
+	a[i] = (
+	    c[0][0] * (c[1][1] * c[2][2] - c[1][2] * c[2][1]) -
+	    c[0][1] * (c[1][0] * c[2][2] - c[1][2] * c[2][0]) +
+	    c[0][2] * (c[1][0] * c[2][1] - c[1][1] * c[2][0])
+	) / det;
+    }
+
+    return true;
+}
+
+/*
+ * Linear between the nearest filled bins around t, the nearest one alone
+ * outside of them. False when no bin is filled yet.
+ */
+
+bool TemperatureTable::gyro(double t, double g[3]) const {
+    int lo = -1, hi = -1;
+
+    for (int i = 0; i < TEMPERATURE_BINS; i++) {
+	if (bin[i].n < minCount)
+	    continue;
+
+	if (bin[i].t <= t)
+	    lo = i;
+	else if (hi < 0)
+	    hi = i;
+    }
+
+    if (lo < 0 && hi < 0)
+	return false;
+
+    if (lo < 0 || hi < 0) {
+	const TemperatureBin &b = bin[lo < 0 ? hi : lo];
+
+	for (int i = 0; i < 3; i++)
+	    g[i] = b.g[i];
+
+	return true;
+    }
+
+    double k = (t - bin[lo].t) / (bin[hi].t - bin[lo].t);
+
+    for (int i = 0; i < 3; i++)
+	g[i] = bin[lo].g[i] + k * (bin[hi].g[i] - bin[lo].g[i]);
+
+    return true;
+}
+
+bool TemperatureTable::accel(double t, double a[3]) const {
+    int		lo = -1, hi = -1;
+    double	al[3], ah[3];
+
+    for (int i = 0; i < TEMPERATURE_BINS; i++) {
+	if (bin[i].n < minCount)
+	    continue;
+
+	if (bin[i].t <= t)
+	    lo = i;
+	else if (hi < 0)
+	    hi = i;
+    }
+
+    if (lo >= 0 && !accelBias(bin[lo], al))
+	lo = -1;
+
+    if (hi >= 0 && !accelBias(bin[hi], ah))
+	hi = -1;
+
+    if (lo < 0 && hi < 0)
+	return false;
+
+    if (lo < 0 || hi < 0) {
+	for (int i = 0; i < 3; i++)
+	    a[i] = lo < 0 ? ah[i] : al[i];
+
+	return true;
+    }
+
+    double k = (t - bin[lo].t) / (bin[hi].t - bin[lo].t);
+
+    for (int i = 0; i < 3; i++)
+	a[i] = al[i] + k * (ah[i] - al[i]);
+
+    return true;
+}
+
+void TemperatureTable::load(json_value& args) {
+    if (!args.is_object()) {
+	return;
+    }
+
+    try {
+	base = number(args["base"]);
+	step = number(args["step"]);
+
+	if (step <= 0) {
+	    step = 2.0;
+	}
+
+	if (args["interval"].is_number()) {
+	    interval = number(args["interval"]);
+	}
+
+	if (args["memory"].is_number() && number(args["memory"]) > 0) {
+	    memory = number(args["memory"]);
+	}
+
+	clear();
+
+	for (auto &item : args["bins"].as_array()) {
+	    double		t = number(item["t"]);
+	    TemperatureBin	&b = bin[index(t)];
+	    auto		&g = item["gyro"].as_array();
+	    auto		&aa = item["accel_aa"].as_array();
+	    auto		&ay = item["accel_ay"].as_array();
+
+	    b.n = item["n"].as_int();
+	    b.w = item["w"].is_null() ? b.n : number(item["w"]);
+	    b.time = item["time"].is_null() ? time(NULL) : number(item["time"]);
+	    b.t = t;
+
+	    for (int i = 0; i < 3; i++) {
+		b.g[i] = number(g[i]);
+		b.ay[i] = number(ay[i]);
+	    }
+
+	    for (int i = 0; i < 6; i++)
+		b.aa[i] = number(aa[i]);
+	}
+    } catch (json_error const &e) {
+	std::cout << e.what() << std::endl;
+	clear();
+    }
+}
+
+void TemperatureTable::store(json_object& args) {
+    json_array	bins;
+
+    for (int i = 0; i < TEMPERATURE_BINS; i++) {
+	const TemperatureBin	&b = bin[i];
+	json_object		item;
+	json_array		g, aa, ay;
+
+	if (b.n == 0)
+	    continue;
+
+	for (int n = 0; n < 3; n++) {
+	    g.push_back(b.g[n]);
+	    ay.push_back(b.ay[n]);
+	}
+
+	for (int n = 0; n < 6; n++)
+	    aa.push_back(b.aa[n]);
+
+	item["t"] = b.t;
+	item["n"] = b.n;
+	item["w"] = b.w;
+	item["time"] = b.time;
+	item["gyro"] = g;
+	item["accel_aa"] = aa;
+	item["accel_ay"] = ay;
+
+	bins.push_back(item);
+    }
+
+    args["base"] = base;
+    args["step"] = step;
+    args["interval"] = interval;
+    args["memory"] = memory;
+    args["bins"] = bins;
+}
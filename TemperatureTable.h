@@ -0,0 +1,66 @@
+#ifndef TEMPERATURE_TABLE_H
+#define TEMPERATURE_TABLE_H
+
+#include <wampcc/json.h>
+
+using namespace wampcc;
+
+#define TEMPERATURE_BINS	50
+
+double number(const json_value& v);	// real or integer JSON value
+
+class TemperatureBin {
+public:
+    int		n = 0;				// windows added
+    double	w = 0;				// their weight after forgetting
+    double	time = 0;			// of the last window, s since the epoch
+    double	t = 0;				// mean temperature of the bin
+    double	g[3] = { 0, 0, 0 };		// gyro offset, raw LSB
+    double	aa[6] = { 0, 0, 0, 0, 0, 0 };	// accel normal equations, upper triangle
+    double	ay[3] = { 0, 0, 0 };
+};
+
+/*
+ * Gyro and accel bias against die temperature, one bin per step degrees
+ * from base. Bins are filled from stationary windows: the gyro average is
+ * the gyro offset, while a resting accelerometer only tells the bias along
+ * gravity, so every window adds one equation n * b = |a| - 1 and the bias
+ * is solved once different orientations were seen.
+ *
+ * Interpolation runs between the mean temperatures of the bins, not
+ * their centers.
+ *
+ * At most one window per interval seconds is added, so the windows do not
+ * overlap and one long rest does not outweigh the orientations seen
+ * before it. Bins forget with the time constant memory, so old data ages
+ * out as the sensor does, however often the bin is filled.
+ */
+
+class TemperatureTable {
+private:
+    double		base = -20.0;
+    double		step = 2.0;
+    double		interval = 10.0;		// s between windows added
+    double		memory = 86400.0;		// s, time constant of forgetting
+    double		last = 0;			// time of the last window added
+    int			minCount = 3;
+
+    TemperatureBin	bin[TEMPERATURE_BINS];
+
+    int index(double t) const;
+    bool accelBias(const TemperatureBin &b, double a[3]) const;
+
+public:
+    void clear();
+    bool empty() const;
+
+    void add(double t, const double gyro[3], const double accel[3]);
+
+    bool gyro(double t, double g[3]) const;
+    bool accel(double t, double a[3]) const;
+
+    void load(json_value& args);
+    void store(json_object& args);
+};
+
+#endif
@@ -1,9 +1,11 @@
 #include <inttypes.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
+#include <math.h>
 #include <iostream>
 
 #include "Compensation.h"
@@ -11,22 +13,85 @@
 #include "MPU6050.h"
 #include "HMC5883L.h"
 #include "MadgwickAHRS.h"
+#include "MahonyAHRS.h"
+#include "EskfAHRS.h"
+#include "Preintegration.h"
+#include "Decimator.h"
+#include "SamplingLoop.h"
+#include "Sample.h"
+#include "SeqLock.h"
+#include "RingBuffer.h"
 
 #define PI 3.141526
+#define FUSE_BATCH 64
 
 using namespace cacaosd_i2cport;
 using namespace cacaosd_mpu6050;
 using namespace cacaosd_hmc5883l;
 using namespace wampcc;
 
-MadgwickAHRS	imu(0.3);
+FusionEngine	*imu = NULL;
 Compensation	comp;
-Control		control(&comp, &imu);
+Control		control(&comp);
 
 MPU6050		*mpu6050 = NULL;
 HMC5883L	*hmc5883L = NULL;
-double		mx = 0, my = 0, mz = 0;
+
+class MagSample {
+public:
+    double	time = 0.0;		// CLOCK_MONOTONIC, s
+    int16_t	m[3] = { 0, 0, 0 };
+};
+
+SeqLock<MagSample>	magCell;	// sequence number is the freshness counter
+unsigned	magSeen = 0;		// sequence of the last mag sample fused
+int16_t		magLast[3] = { 0, 0, 0 };	// last mag words, a repeated reading has the same
+bool		magReady = false;		// RDY at the last poll of the HMC5883L
+double		magTimeout = 0.1;	// s, older mag samples are not fused
 double		dt = 1.0/500.0;
+double		samplePeriod = dt;		// s, nominal period between fused samples
+double		framePeriod = dt;		// s, between raw samples, shorter when decimating
+double		sensorDelay = 0.0;		// s, DLPF group delay
+bool		auxMag = false;
+
+bool		fifoMode = false;
+int		fifoPeriod = 10;		// ms
+double		fifoTime = 0.0;			// s, time of the last frame drained
+int16_t		fifoFrames[FIFO_SIZE / 12 * FIFO_FRAME_WORDS];	// 12 bytes - smallest frame
+Sample		fifoSamples[FIFO_SIZE / 12];
+
+Decimator	decimator;			// raw rate to fusion rate, acquisition side
+Sample		decimated[FIFO_SIZE / 12];
+
+typedef enum {
+    OVERRUN_SKIP,			// drop missed ticks, fuse the next sample with the real dt
+    OVERRUN_CATCHUP,			// sample into the FIFO at the tick rate, drain the backlog
+    OVERRUN_DEGRADE			// fuse with updateIMU while the loop is late
+} overrun_policy_t;
+
+overrun_policy_t overrunPolicy = OVERRUN_SKIP;
+
+int		rtPriority = 0;			// SCHED_FIFO, 0 - disabled
+int		rtCpu = -1;			// -1 - any
+bool		rtLockMemory = false;
+
+SamplingLoop	*gyroLoop = NULL;
+SamplingLoop	*magLoop = NULL;
+
+bool		hwOffsets = false;		// offsets applied by the MPU6050 itself
+bool		gyroTracking = true;		// refine the gyro offset while running
+FILE		*recordFile = NULL;		// corrected samples for fusion_bench
+bool		pipeline = false;		// acquisition and fusion on separate threads
+int		fusionCpu = -1;
+RingBuffer<Sample, 256>	sampleRing;
+SamplingLoop	*fusionLoop = NULL;
+
+Preintegration	preint;				// fusion side, keyframes for the navigation
+double		preintTime = 0.0;		// last sample in it
+double		keyframePeriod = 0.0;		// 0 - navigation integrates every sample
+RingBuffer<Keyframe, 64> keyframeRing;
+Navigation	*nav = NULL;
+SamplingLoop	*navLoop = NULL;
 
 double time_ns() {
     struct timespec spec;
@@ -36,126 +101,286 @@ double time_ns() {
     return spec.tv_sec + spec.tv_nsec / 1.0e9;
 }
 
-void mag_work(union sigval) {
-    mx = hmc5883L->getMagnitudeX();
-    my = hmc5883L->getMagnitudeY();
-    mz = hmc5883L->getMagnitudeZ();
+/*
+ * RDY stays high while the same measurement is read again, so a reading is
+ * new when RDY was low at the last poll or the data changed. A new
+ * measurement equal to the last one is lost, it would add nothing.
+ */
+
+void mag_work() {
+    MagSample	mag;
+    bool	ready = hmc5883L->getMagnitudes(mag.m) & (1 << RDY_BIT);
+
+    if (ready && (!magReady || memcmp(magLast, mag.m, sizeof(magLast)) != 0)) {
+	mag.time = time_ns();
+	magCell.store(mag);
+	memcpy(magLast, mag.m, sizeof(magLast));
+    }
+
+    magReady = ready;
 }
 
-void gyro_work(union sigval) {
-    int16_t	m[9];
-    double	d[9];
+void attach_mag(Sample &sample) {
+    MagSample	mag;
+    unsigned	seq = magCell.load(mag);
 
-    mpu6050->getMotions6(m);
+    if (seq == 0 || sample.time - mag.time > magTimeout) {
+	sample.m[6] = 0;
+	sample.m[7] = 0;
+	sample.m[8] = 0;
+	sample.magFresh = false;
+	return;
+    }
 
-    m[6] = mx;
-    m[7] = my;
-    m[8] = mz;
+    sample.m[6] = mag.m[0];
+    sample.m[7] = mag.m[1];
+    sample.m[8] = mag.m[2];
+    sample.magFresh = (seq != magSeen);
 
-    comp.doIt(m, d);
+    magSeen = seq;
+}
 
-    for (int i = 0; i < 3; i++) {
-	d[i] = d[i] * 2.0 / 32768.0;
-	d[i+3] = d[i+3] * 1000.0 / 32768.0;
-	d[i+6] = d[i+6] / 1024.0;
+/* Mag routed through the MPU6050 is repeated in every frame until the next slave read */
+
+void check_aux_mag(Sample &sample) {
+    HMC5883L::orderMagnitudes(&sample.m[6]);
+
+    sample.magFresh = memcmp(magLast, &sample.m[6], sizeof(magLast)) != 0;
+    memcpy(magLast, &sample.m[6], sizeof(magLast));
+}
+
+bool late(SamplingLoop *loop) {
+    if (overrunPolicy != OVERRUN_DEGRADE) {
+	return false;
     }
 
-    if (hmc5883L) {
-	imu.update(dt,  d[3], d[4], d[5],  d[0], d[1], d[2],  d[6], d[7], d[8]);
-    } else {
-	imu.updateIMU(dt,  d[3], d[4], d[5],  d[0], d[1], d[2]);
+    return loop->getMissed() > 0 || loop->getLateness() > loop->getPeriod() / 2;
+}
+
+/*
+ * Corrected samples as text, one per line: time, accel, gyro, mag. Input of
+ * fusion_bench, for comparing the engines on real data.
+ */
+
+void record_batch(const Sample *samples, const float *d, int n) {
+    for (int i = 0; i < n; i++, d += 9) {
+	fprintf(recordFile, "%.6f %g %g %g %g %g %g %g %g %g\n",
+	    samples[i].time, d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7], d[8]);
+    }
+}
+
+/*
+ * Adds the corrected samples to the open keyframe. A keyframe is closed at
+ * the end of a batch, where the filter state is that of its last sample,
+ * and the next one starts at that attitude and the bias the filter has
+ * then. The navigation gets the same bias, so it corrects the keyframes
+ * taken with an older one.
+ */
+
+void preintegrate(const Sample *samples, const float *d, int n) {
+    for (int i = 0; i < n; i++, d += 9) {
+	double	dt = samples[i].time - preintTime;
+
+	if (preintTime == 0.0 || dt <= 0.0 || dt > samplePeriod * 10.0) {
+	    dt = samplePeriod;
+	}
+
+	preintTime = samples[i].time;
+	preint.add(samples[i].time, dt, d);
     }
 
-    imu.gravityCompensate(d[0], d[1], d[2]);
-    imu.integrate(dt);
+    if (preint.elapsed() >= keyframePeriod) {
+	Keyframe	k;
+	AHRSState	state;
+
+	preint.close(k);
+	keyframeRing.push(k);
+
+	imu->getState(state);
+
+	double q[4] = { state.q0, state.q1, state.q2, state.q3 };
+	double bg[3], ba[3] = { 0, 0, 0 };
+
+	if (imu->getGyroBias(bg)) {
+	    preint.setBias(bg, ba);
+	    nav->setBias(bg, ba);
+	}
+
+	preint.open(q, state.converged);
+    }
+}
+
+void nav_work() {
+    Keyframe	k;
+
+    while (keyframeRing.pop(k)) {
+	nav->add(k);
+    }
+}
+
+void fuse_batch(const Sample *samples, int n, bool degraded) {
+    float	d[FUSE_BATCH * 9];
+
+    while (n > 0) {
+	int count = n < FUSE_BATCH ? n : FUSE_BATCH;
+
+	comp.doIt(samples[0].m, sizeof(Sample), count, d);
+
+	if (recordFile) {
+	    record_batch(samples, d, count);
+	}
+
+	imu->updateBatch(samples, d, count, samplePeriod, hmc5883L && !degraded);
+
+	if (nav) {
+	    preintegrate(samples, d, count);
+	}
+
+	for (int i = 0; i < count && gyroTracking; i++) {
+	    comp.calibrateItem(samples[i].m);
+	}
+
+	samples += count;
+	n -= count;
+    }
 }
 
-void calibrate_work(union sigval) {
-    int16_t	m[9];
+void deliver(const Sample *samples, int n) {
+    if (decimator.getFactor() > 1) {
+	int	m = 0;
 
-    mpu6050->getMotions6(m);
+	for (int i = 0; i < n; i++) {
+	    if (decimator.push(samples[i], decimated[m])) {
+		m++;
+	    }
+	}
 
-    if (hmc5883L) {
-	m[6] = hmc5883L->getMagnitudeX();
-	m[7] = hmc5883L->getMagnitudeY();
-	m[8] = hmc5883L->getMagnitudeZ();
+	samples = decimated;
+	n = m;
+    }
+
+    if (pipeline) {
+	for (int i = 0; i < n; i++) {
+	    sampleRing.push(samples[i]);
+	}
     } else {
-	m[6] = 0;
-	m[7] = 0;
-	m[8] = 0;
+	fuse_batch(samples, n, late(gyroLoop));
     }
+}
 
-    comp.calibrateItem(m);
+void fusion_work() {
+    Sample	batch[FUSE_BATCH];
+    bool	degraded = late(fusionLoop);
+    int		n;
+
+    do {
+	n = 0;
+
+	while (n < FUSE_BATCH && sampleRing.pop(batch[n])) {
+	    n++;
+	}
+
+	fuse_batch(batch, n, degraded);
+    } while (n == FUSE_BATCH);
 }
 
-void gyro_timer() {
-    struct itimerspec	its;
-    timer_t		timerid;
-    struct sigevent	sev;
+void gyro_work() {
+    Sample	sample;
+    double	start = time_ns();
 
-    memset((void *) &sev, 0, sizeof(sev));
+    if (!mpu6050->getMotionFrame(sample.m)) {
+	gyroLoop->countDrop();
+	return;
+    }
 
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = &gyro_work;
+    /* Registers are latched somewhere during the transfer */
 
-    timer_create(CLOCK_REALTIME, &sev, &timerid);
+    sample.time = (start + time_ns()) / 2.0 - sensorDelay;
 
-    its.it_value.tv_sec = 0;
-    its.it_value.tv_nsec = 1000000000 * dt;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+    if (auxMag) {
+	check_aux_mag(sample);
+    } else {
+	attach_mag(sample);
+    }
 
-    timer_settime(timerid, 0, &its, NULL);
+    deliver(&sample, 1);
 }
 
-void mag_timer() {
-    struct itimerspec	its;
-    timer_t		timerid;
-    struct sigevent	sev;
+void fifo_work() {
+    const int	maxFrames = sizeof(fifoFrames) / sizeof(fifoFrames[0]) / FIFO_FRAME_WORDS;
+    int		available;
+    double	now = time_ns();
+    int		n = mpu6050->readFIFO_Frames(fifoFrames, maxFrames, &available);
+
+    if (n < 0) {
+	gyroLoop->countDrop();
+	decimator.reset();
+	return;
+    }
+
+    /* The newest frame in the FIFO was taken right before the count was read */
 
-    memset((void *) &sev, 0, sizeof(sev));
+    double first = now - sensorDelay - (available - 1) * framePeriod;
 
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = &mag_work;
+    for (int i = 0; i < n; i++) {
+	Sample	&sample = fifoSamples[i];
 
-    timer_create(CLOCK_REALTIME, &sev, &timerid);
+	memcpy(sample.m, &fifoFrames[i * FIFO_FRAME_WORDS], sizeof(sample.m));
 
-    its.it_value.tv_sec = 0;
-    its.it_value.tv_nsec = 1000000000 / 75;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+	sample.time = first + i * framePeriod;
 
-    timer_settime(timerid, 0, &its, NULL);
+	/* Keep the reconstructed timebase monotonic across drains */
+
+	if (sample.time <= fifoTime) {
+	    sample.time = fifoTime + framePeriod;
+	}
+
+	fifoTime = sample.time;
+
+	if (auxMag) {
+	    check_aux_mag(sample);
+	} else {
+	    attach_mag(sample);
+	}
+    }
+
+    deliver(fifoSamples, n);
 }
 
-timer_t calibrate_timer(int freq) {
-    struct itimerspec	its;
-    timer_t		timerid;
-    struct sigevent	sev;
+void calibrate_work() {
+    int16_t	m[FIFO_FRAME_WORDS];
 
-    memset((void *) &sev, 0, sizeof(sev));
+    if (!mpu6050->getMotionFrame(m)) {
+	return;
+    }
 
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = &calibrate_work;
+    if (auxMag) {
+	HMC5883L::orderMagnitudes(&m[6]);
+    } else if (hmc5883L) {
+	hmc5883L->getMagnitudes(&m[6]);
+    }
 
-    timer_create(CLOCK_REALTIME, &sev, &timerid);
+    comp.calibrateItem(m);
+    comp.calibrateMag(&m[6]);
+}
 
-    its.it_value.tv_sec = 0;
-    its.it_value.tv_nsec = 1000000000 / freq;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+SamplingLoop* sampling_loop(std::function<void()> work, long period) {
+    SamplingLoop *loop = new SamplingLoop(work, period);
 
-    timer_settime(timerid, 0, &its, NULL);
+    loop->setPriority(rtPriority);
+    loop->setCpu(rtCpu);
 
-    return timerid;
+    return loop;
 }
 
 void calibration() {
-    timer_t	id = calibrate_timer(500);
-    double	timeout = time_ns() + 5.0;
+    SamplingLoop	*loop = sampling_loop(calibrate_work, 1000000000L / 500);
+    double		timeout = time_ns() + 5.0;
 
-    std::cout << "Calibration: run" << std::endl;
     comp.clearCalibration();
+    loop->start();
+
+    std::cout << "Calibration: run" << std::endl;
 
     while (true) {
 	double gx, gy, gz, gr;
@@ -165,7 +390,7 @@ void calibration() {
 	comp.getAccelSigma(ax, ay, az, ar);
 
 	if (comp.calcGyro(120.0)) {
-	    imu.setAccelSigma(ar * 3.0);
+	    imu->setAccelSigma(ar * 3.0);
 
 	    printf(
 		"Gyro:  %6.3f\t%6.3f\t%6.3f\t%6.2f\t%6.3f\t%6.3f\t%6.3f\n", 
@@ -186,11 +411,16 @@ void calibration() {
 	    timeout = time_ns() + 5.0;
 	}
 
-	if (comp.calcMag()) {
+	if (comp.calcMag(0.05, 3.0)) {
+	    double	me, mr;
+	    int		mn;
+
+	    comp.getMagFit(me, mr, mn);
+
 	    printf(
-		"Mag:   %6.3f\t%6.3f\t%6.3f\t\t%6.3f\t%6.3f\t%6.3f\n",
+		"Mag:   %6.3f\t%6.3f\t%6.3f\t\t%6.4f\t%6.3f\t%6d\n",
 		comp.m_offset[0], comp.m_offset[1], comp.m_offset[2],
-		comp.m_scale[0], comp.m_scale[1], comp.m_scale[2]
+		me, mr, mn
 	    );
 
 	    timeout = time_ns() + 5.0;
@@ -203,15 +433,134 @@ void calibration() {
 	usleep(1000000/10);
     }
 
-    timer_delete(id);
+    delete loop;
     control.storeConfig("imu.json");
     std::cout << "Calibration: done" << std::endl;
 }
 
+/*
+ * Moves the computed accel and gyro offsets into the MPU6050 offset
+ * registers, so the raw data and the FIFO come out bias-free. Software
+ * keeps only the remainder below one register step, imu.json still gets
+ * the full offsets.
+ */
+
+void program_offsets() {
+    double	accel[3], gyro[3];
+    bool	moved = false;
+
+    mpu6050->shiftOffsets(comp.a_offset, comp.g_offset, accel, gyro);
+    comp.shiftOffsets(accel, gyro);
+
+    mpu6050->getAccelOffsets(comp.a_hw);
+    mpu6050->getGyroOffsets(comp.g_hw);
+
+    for (int i = 0; i < 3; i++) {
+	moved = moved || accel[i] != 0 || gyro[i] != 0;
+    }
+
+    if (moved || !comp.hwValid) {
+	comp.hwValid = true;
+	control.storeConfig("imu.json");
+    }
+}
+
+// SIGTERM and SIGINT end the control loop, which writes a last checkpoint
+
+void on_signal(int sig) {
+    control.stop();
+}
+
 int main() {
     control.loadConfig("imu.json");
     control.init();
 
+    fifoMode = control.getOption("fifo", fifoMode);
+    fifoPeriod = control.getOption("fifo_period", fifoPeriod);
+    auxMag = control.getOption("aux_mag", auxMag);
+    rtPriority = control.getOption("rt_priority", rtPriority);
+    rtCpu = control.getOption("rt_cpu", rtCpu);
+    rtLockMemory = control.getOption("rt_mlock", rtLockMemory);
+
+    comp.setWindow(control.getOption("calibration_window", comp.getWindow()));
+
+    /* Oversampling, the sensor runs decimation times faster than the fusion */
+
+    int decimation = control.getOption("decimation", 1);
+
+    if (decimation > 1) {
+	bool ok;
+
+	if (control.getStringOption("decimation_filter", "fir") == "cic") {
+	    ok = decimator.setCIC(decimation, control.getOption("cic_order", 2));
+	} else {
+	    ok = decimator.setFIR(decimation, control.getOption("decimation_taps", 31));
+	}
+
+	if (!ok) {
+	    std::cout << "Decimation: bad filter, off" << std::endl;
+	}
+    }
+
+    gyroTracking = control.getOption("gyro_tracking", gyroTracking);
+    hwOffsets = control.getOption("hw_offsets", hwOffsets);
+    pipeline = control.getOption("pipeline", pipeline);
+    fusionCpu = control.getOption("fusion_cpu", fusionCpu);
+
+    std::string policy = control.getStringOption("overrun_policy", "skip");
+
+    if (policy == "catchup") {
+	overrunPolicy = OVERRUN_CATCHUP;
+    } else if (policy == "degrade") {
+	overrunPolicy = OVERRUN_DEGRADE;
+    }
+
+    std::string fusion = control.getStringOption("fusion", "madgwick");
+
+    if (fusion == "mahony") {
+	imu = new MahonyAHRS(control.getOption("mahony_kp", 0.5), control.getOption("mahony_ki", 0.0));
+    } else if (fusion == "eskf") {
+	imu = new EskfAHRS(
+	    control.getOption("eskf_gyro_noise", 0.0005),
+	    control.getOption("eskf_bias_noise", 0.00002),
+	    control.getOption("eskf_accel_noise", 0.05),
+	    control.getOption("eskf_mag_noise", 0.05),
+	    control.getOption("eskf_accel_rate", 50.0),
+	    control.getOption("eskf_mag_rate", 25.0)
+	);
+    } else {
+	imu = new MadgwickAHRS(control.getOption("madgwick_beta", 0.3));
+    }
+
+    imu->setAlignment(
+	control.getOption("align_time", 0.25),
+	control.getOption("align_gain", 10.0),
+	control.getOption("align_tau", 0.5)
+    );
+
+    control.setFusion(imu);
+
+    /* Navigation off the sampling path, at the keyframe rate */
+
+    double navRate = control.getOption("nav_rate", 0.0);
+
+    if (navRate > 0) {
+	keyframePeriod = 1.0 / navRate;
+	nav = new Navigation(control.getOption("nav_zupt", 0.3));
+	imu->setIntegration(false);
+	control.setNavigation(nav);
+    }
+
+    std::string record = control.getStringOption("record", "");
+
+    if (!record.empty()) {
+	recordFile = fopen(record.c_str(), "w");
+    }
+
+    if (rtLockMemory) {
+	SamplingLoop::lockMemory();
+    }
+
     I2cPort *i2c0 = new I2cPort(0x68, 0);
     i2c0->openConnection();
 
@@ -220,13 +569,36 @@ int main() {
 
         mpu6050->setRangeAcceleration(0);	// 2g
         mpu6050->setRangeGyroscope(2);		// 1000 gr/s
+
+	comp.setUnits(2.0 / 32768.0, 1000.0 / 32768.0, 1.0 / 1024.0);
+	decimator.setGyroScale(1000.0 / 32768.0 * M_PI / 180.0);
 	mpu6050->setSampleRate(0);
         mpu6050->setDLPFMode(6);
         mpu6050->setSleepMode(false);
+
+	/* Raw rate decimation times the fusion rate, or no decimation at all */
+
+	if (decimator.getFactor() > 1) {
+	    double	base = mpu6050->getSamplePeriod();
+	    double	raw = dt / decimator.getFactor();
+	    int		div = (int) (raw / base + 0.5) - 1;
+
+	    if (div < 0 || div > 255 || fabs((div + 1) * base - raw) > raw * 0.01) {
+		std::cout << "Decimation: sensor can't sample at " << 1.0 / raw << " Hz, off" << std::endl;
+		decimator = Decimator();
+	    } else {
+		mpu6050->setSampleRate(div);
+	    }
+	}
     } else {
         exit(1);
     }
 
+    if (auxMag) {
+	mpu6050->setI2CMasterMode(false);
+	mpu6050->setI2CBypass(true);
+    }
+
     I2cPort *i2c1 = new I2cPort(0x1E, 0);
     i2c1->openConnection();
 
@@ -241,18 +613,119 @@ int main() {
     }
     #endif
 
-    if (!comp.calibrated()) {
+    if (auxMag && hmc5883L) {
+	int delay = (int) (1.0 / (75.0 * mpu6050->getSamplePeriod())) - 1;
+
+	mpu6050->setupAuxiliaryRead(HMC5883L_DEV_ADD, X_HIGH, 6, delay < 0 ? 0 : delay);
+    } else {
+	auxMag = false;
+    }
+
+    if (hwOffsets && comp.hwValid) {
+	mpu6050->setAccelOffsets(comp.a_hw);
+	mpu6050->setGyroOffsets(comp.g_hw);
+	comp.applyHardware();
+    }
+
+    /* Offsets for the current die temperature, before anything is sampled */
+
+    if (gyroTracking) {
+	comp.applyTemperature(comp.getTemperature(mpu6050->getTemperature()));
+    }
+
+    /* Warm start: noise thresholds, the window and a recent attitude */
+
+    control.setCheckpoint(
+	control.getStringOption("checkpoint", "imu.ckpt"),
+	control.getOption("checkpoint_interval", 10.0)
+    );
+
+    control.loadCheckpoint(control.getOption("checkpoint_age", 300.0));
+
+    if (!comp.calibrated(!gyroTracking)) {
 	calibration();
     }
 
-    gyro_timer();
+    if (hwOffsets) {
+	program_offsets();
+    }
+
+    if (gyroTracking) {
+	control.setGyroTracking(
+	    control.getOption("gyro_tracking_noise", 20.0),
+	    control.getOption("gyro_tracking_rate", 100.0),
+	    control.getOption("gyro_tracking_gain", 0.05),
+	    control.getOption("gyro_tracking_store", 600.0)
+	);
+    }
+
+    sensorDelay = mpu6050->getGroupDelay();
+
+    framePeriod = dt / decimator.getFactor();
+
+    if (overrunPolicy == OVERRUN_CATCHUP && !fifoMode) {
+	double	base = mpu6050->getSamplePeriod() / (1 + mpu6050->getSampleRate());
+	int	div = (int) (framePeriod / base + 0.5) - 1;
 
-    if (hmc5883L) {
-	mag_timer();
+	mpu6050->setSampleRate(div < 0 ? 0 : div);
+
+	fifoMode = true;
+	fifoPeriod = dt * 1000.0;
     }
 
-    imu.setAccelSigma(0.002);
+    if (fifoMode) {
+	framePeriod = mpu6050->getSamplePeriod();
+	samplePeriod = framePeriod * decimator.getFactor();
+	decimator.setPeriod(framePeriod);
+	mpu6050->setupFIFO(true, auxMag);
+	gyroLoop = sampling_loop(fifo_work, 1000000L * fifoPeriod);
+    } else {
+	decimator.setPeriod(framePeriod);
+	gyroLoop = sampling_loop(gyro_work, (long) (1000000000L * framePeriod));
+    }
+
+    control.setSamplingLoop(gyroLoop);
+
+    if (pipeline) {
+	fusionLoop = sampling_loop(fusion_work, gyroLoop->getPeriod());
+	fusionLoop->setCpu(fusionCpu);
+	fusionLoop->start();
+
+	control.setPipeline(&sampleRing, fusionLoop);
+    }
+
+    if (nav) {
+	navLoop = new SamplingLoop(nav_work, (long) (1000000000L * keyframePeriod));
+	navLoop->start();
+    }
+
+    gyroLoop->start();
+
+    if (hmc5883L && !auxMag) {
+	magLoop = sampling_loop(mag_work, 1000000000L / 75);
+	magLoop->start();
+    }
+
+    imu->setAccelSigma(0.002);
+
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+
     control.work();
 
+    gyroLoop->stop();
+
+    if (magLoop) {
+	magLoop->stop();
+    }
+
+    if (fusionLoop) {
+	fusionLoop->stop();
+    }
+
+    if (navLoop) {
+	navLoop->stop();
+    }
+
     return 0;
 }